@@ -39,12 +39,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <time.h>
@@ -53,12 +55,46 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <limits.h>
+#include <math.h>
 #include <pwd.h>
 #include <grp.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/un.h>
+#include <net/if.h>
+#include <sys/file.h>
+#ifndef DISABLE_THREADS
+#include <pthread.h>
+#include <semaphore.h>
+#endif
 
 #ifdef ENABLE_HTTPS
+#ifdef TLS_MBEDTLS
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#ifdef MBEDTLS_PSA_CRYPTO_C
+#include <psa/crypto.h>
+#endif
+#else
 #include <openssl/ssl.h>
 #endif
+#endif
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/capability.h>
+#include <linux/seccomp.h>
+#include <linux/filter.h>
+#include <linux/audit.h>
+#endif
+
 
 #if defined BSD || defined __FreeBSD__
 #define adjtimex ntp_adjtime
@@ -76,61 +112,442 @@
 #define	DEFAULT_MAX_SLEEP		115200			/* 32 hours */
 #define	MAX_DRIFT			32768000		/* 500 PPM */
 #define	MAX_ATTEMPT			2			/* Poll attempts */
+#define	DEFAULT_ACCURACY		500000			/* 0.5 s */
+#define	SLEW_RATE			500e-6			/* adjtime() */
+#define	POLL_LIMIT			4			/* cycles to lengthen poll */
+#define	JUMP_CHECK			60			/* compare clocks (s) */
+#define	JUMP_LIMIT			2.0			/* suspend or step (s) */
 #define	DEFAULT_PID_FILE		"/var/run/htpdate.pid"
+#define	STATUS_MAGIC			0x48545053		/* "HTPS" */
+#define	STATUS_VERSION			2
+#define	NTPD_SHM_BASE			0x4e545030		/* "NTP0" */
+#define	NTPD_SHM_UNITS			4			/* NTP0 ... NTP3 */
 #define	URLSIZE				128
 #define	BUFFERSIZE			1024
+#define	METRICSSIZE			65536
+#define	LOGRINGSIZE			256			/* power of 2 */
+#define	LOGLINESIZE			1024
+#define	SAMPLERINGSIZE			64			/* dumped on SIGUSR1 */
+#define	MAX_WORKERS			64
+#define	PROXY_LEGS			8			/* origin leg history */
+#define	PROXY_MAX_DELAY			250000			/* 250 ms */
+#define	RTT_BUCKETS			10
+#define	BREAKER_FAILURES		3			/* failed polls in a row */
+#define	BACKOFF_MIN			60			/* 1 minute */
+#define	DNS_TTL				3600			/* cached name lookup */
+#define	BURST_PROBES			8			/* concurrent, per server */
+#define	IO_TIMEOUT			10			/* connect, send, receive (s) */
+#define	IDLE_TIMEOUT			60			/* reuse of a connection (s) */
+#define	JOURNAL_MAGIC			0x4854504a		/* "HTPJ" */
+#define	JOURNAL_VERSION			1
+#define	JOURNAL_RECORDS			65536			/* per file, 4.5 MB */
+#define	JOURNAL_SERVERS			64			/* name table */
+#define	OUTPUTSIZE			16384
 
 #define sign(x) (x < 0 ? (-1) : 1)
 
+#ifdef SIMULATOR
+#define	SIMOPTIONS			"S:"
+#define	SIM_STEP			60			/* statistics interval */
+#define	SIM_SLEW_RATE			500e-6			/* adjtime() 500 PPM */
+#else
+#define	SIMOPTIONS			""
+#endif
+
 
 /* By default we turn off "debug" and "log" mode  */
 static int		debug = 0;
 static int		logmode = 0;
+static int		http2 = 0;
+static int		fastopen = 0;
 
 
-/* Make mktime timezone agnostic, see manpage timegm */
-time_t gmtmktime (struct tm *tm)
-{
-	char *tz;
-	time_t result;
+/* NTP shared memory refclock segment, as read by ntpd (refclock type 28)
+   and chrony (refclock SHM). The layout is fixed by ntpd, don't touch.
+*/
+struct shmTime {
+	int			mode;		/* 1: count/valid protocol */
+	volatile int		count;
+	time_t			clockTimeStampSec;
+	int			clockTimeStampUSec;
+	time_t			receiveTimeStampSec;
+	int			receiveTimeStampUSec;
+	int			leap;
+	int			precision;	/* log2(seconds) */
+	int			nsamples;
+	volatile int		valid;
+	unsigned		clockTimeStampNSec;
+	unsigned		receiveTimeStampNSec;
+	int			dummy[8];
+};
+
+#ifndef DISABLE_NTPSHM
+static struct shmTime	*ntpshm = NULL;
+#endif
 
-	/* Temporarily set timezone to UTC for conversion */
-	tz = getenv("TZ");
-	if (tz) {
-		tz = strdup (tz);
-	}
-	setenv("TZ", "", 1);
-	tzset();
 
-	result = mktime (tm);
+/* Error classes of a failed poll */
+enum {
+	ERR_DNS,				/* host or service unavailable */
+	ERR_CONNECT,				/* connection failed */
+	ERR_TLS,				/* TLS handshake failed */
+	ERR_IO,					/* sending or receiving failed */
+	ERR_NODATE,				/* no Date: header */
+	ERR_FORMAT,				/* unknown time format */
+	ERR_PROXY,				/* excessive proxy delay */
+	ERR_CACHED,				/* cached response */
+	NUM_ERRORS
+};
+
+static const char	*errorname[NUM_ERRORS] = {
+	"dns", "connect", "tls", "io", "nodate", "format", "proxy", "cached"
+};
+
+
+/* Log messages are queued in a ring buffer and written by a separate thread,
+   so a slow syslog or terminal never delays a measurement. Producers claim
+   a slot with a CAS on "head", when the ring is full messages are dropped.
+*/
+static struct {
+	volatile unsigned	head, tail;
+	volatile int		ready[LOGRINGSIZE];
+	int			is_error[LOGRINGSIZE];
+	char			line[LOGRINGSIZE][LOGLINESIZE];
+	volatile unsigned long	dropped;
+	volatile int		running, stop, dump;
+	int			structured;	/* key=value records */
+#ifndef DISABLE_THREADS
+	sem_t			sem;
+	pthread_t		writer;
+#endif
+} logring;
+
+
+/* Machine readable output of the poll cycles (-o), buffered */
+#define	OUTPUT_CSV			1
+#define	OUTPUT_JSON			2
+#define	OUTPUT_INFLUX			3			/* line protocol */
+
+static struct {
+	int			format;
+	char			buf[OUTPUTSIZE];
+	int			len;
+} output;
+
+
+/* The last measurements, for post-mortems */
+struct samplerecord {
+	struct timeval		time;
+	char			host[64];
+	char			port[8];
+	long			rtt;		/* us */
+	double			offset;		/* s */
+	int			err;		/* error class or NUM_ERRORS */
+};
+
+static struct {
+	struct samplerecord	rec[SAMPLERINGSIZE];
+	volatile unsigned	count;
+} samplering;
+
+
+/* Upper bounds (us) of the round trip time histogram, the last is +Inf */
+static const long	rttbucket[RTT_BUCKETS-1] = {
+	5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
+
+
+/* A time offset sample, the true offset lies within [lower, upper] (ns) */
+struct interval {
+	int64_t			lower, upper;
+};
+
+/* Per web server state, kept across poll cycles */
+struct server {
+	char			*host;
+	char			*port;
+	long			rtt;		/* last round trip time (us) */
+	time_t			lastpoll;	/* last successful poll */
+	unsigned long		polls;
+	unsigned long		failures;
+	unsigned long		errors[NUM_ERRORS];
+	unsigned long		rtthist[RTT_BUCKETS];
+	double			rttsum;		/* sum of round trip times (s) */
+	int			worker;		/* shard */
+	long			connrtt;	/* TCP connect time (us) */
+	long			legs[PROXY_LEGS];	/* proxy to web server (us) */
+	int			nlegs;
+	time_t			lastdate;	/* last Date: */
+	long			pingrtt;	/* HTTP/2 PING round trip (us) */
+	double			sent;		/* request sent (monotime) */
+	double			firstbyte;	/* response started (monotime) */
+	long			tcprtt;		/* TCP_INFO round trip (us) */
+	long			proc;		/* server processing, average (us) */
+	long			bound;		/* error bound of last sample (us) */
+	int			lasterror;	/* of last poll, NUM_ERRORS if none */
+	int			consecutive;	/* failed polls in a row */
+	time_t			retry;		/* circuit breaker open until */
+	struct addrinfo		*addr;		/* cached name lookup */
+	time_t			resolved;
+	struct server		*parent;	/* of a burst probe */
+	struct interval		sample;		/* last offset interval */
+	char			address[INET6_ADDRSTRLEN];	/* connected to */
+	unsigned		polled;		/* poll cycle of last poll */
+	char			*path;		/* source binding, "" if none */
+	char			dev[IFNAMSIZ];	/* interface */
+	struct addrinfo		*src;		/* source address */
+	unsigned		mark;		/* firewall mark */
+#ifdef ENABLE_HTTPS
+	struct tlsconn		*tunnel;	/* CONNECT tunnel, or HTTP/1.1 */
+	struct h2conn		*h2;		/* HTTP/2 connection */
+	double			used;		/* tunnel or h2 last used (monotime) */
+#endif
+};
+
+
+/* Preaggregated counters for the metrics listener */
+static struct {
+	int			fd;		/* listening socket */
+	unsigned long		cycles;
+	double			cycletime;	/* duration of last cycle (s) */
+	double			offset;		/* last combined time offset (s) */
+	double			error;
+	double			drift;		/* s/s */
+	unsigned long		adjustments;
+	double			adjustsum;	/* sum of |adjustments| (s) */
+	double			lastadjust;
+	unsigned long		freqadjustments;
+	struct server		*servers;
+	int			numservers;
+	struct server		*proxy;
+#ifndef DISABLE_METRICS
+	char			buf[METRICSSIZE];
+	int			len;
+#endif
+} metrics = { -1 };
+
+
+/* Requests from the control socket. Server changes and poll bounds are
+   applied by the main loop, in between poll cycles.
+*/
+static struct {
+	int			fd;		/* listening socket */
+	int			pause;		/* measure, don't correct */
+	int			minsleep, maxsleep;	/* new poll bounds */
+	int			nedits;
+	char			edit[MAX_HTTP_HOSTS+1][URLSIZE];	/* +/-host:port */
+} control = { -1 };
+
+
+/* Clock, sleep and network primitives. The simulator (make htpsim)
+   replaces them by a virtual clock and modeled web servers.
+*/
+struct clockops {
+	int			(*gettime)( struct timeval *tv );
+	double			(*monotime)( void );
+	void			(*wait)( struct timespec *ts );
+	void			(*sleep)( unsigned int seconds );
+	int			(*connect)( struct server *srv, char *proxy, char *proxyport, int ipversion );
+	int			(*exchange)( struct server *srv, int server_s, char *buffer );
+	int			(*adjtime)( struct timeval *delta );
+	int			(*settime)( struct timeval *tv );
+	int			(*adjtimex)( struct timex *tmx );
+};
+
+static const struct clockops	*ops;
+
+
+/* Clock change request to the privileged helper process and its reply,
+   one fixed size message each way on a socketpair
+*/
+#define	HELPER_ADJTIME			1
+#define	HELPER_SETTIME			2
+#define	HELPER_ADJTIMEX			3
+
+struct helpermsg {
+	int32_t			op;
+	int32_t			result;
+	int32_t			error;		/* errno of a failed request */
+	struct timeval		tv;
+	struct timex		tmx;
+};
+
+static int		helperfd = -1;
 
-	/* Restore timezone */
-	if (tz) {
-		setenv("TZ", tz, 1);
-		free (tz);
-	} else {
-		unsetenv("TZ");
-	}
-	tzset();
 
-	return result;
+/* A poll cycle, shared with the worker threads. Workers append offset
+   intervals to samples[] by claiming a slot atomically.
+*/
+static struct {
+	char			*proxy, *proxyport, *httpversion;
+	int			ipversion, timelimit, burstmode, numservers;
+	int			nap;
+	unsigned		id;		/* cycle number */
+	struct interval		samples[(MAX_HTTP_HOSTS+1)*(MAX_HTTP_HOSTS+1)-1];
+	volatile int		validtimes;
+	volatile int		offsetdetect;
+} cycle;
+
+
+/* Measurement worker threads, each polls its own shard of web servers */
+static struct {
+	int			n;
+#ifndef DISABLE_THREADS
+	pthread_t		thread[MAX_WORKERS];
+	sem_t			go[MAX_WORKERS];
+	sem_t			done;
+#endif
+	struct server		*servers;
+	int			when;		/* "when" of the first poll */
+} workers;
+
+
+/* Status page, a read-only mmap'd file for local readers. A reader copies
+   the page and retries when "seq" was odd or changed meanwhile (seqlock).
+   Only fixed size types, the layout is part of the interface.
+*/
+struct htpstatus_server {
+	char			host[64];
+	char			port[8];
+	double			offset;		/* middle of last sample (s) */
+	double			error;		/* error bound of last sample (s) */
+	double			rtt;		/* last round trip time (s) */
+	int64_t			lastpoll;	/* last successful poll */
+	uint64_t		polls;
+	uint64_t		failures;
+};
+
+struct htpstatus {
+	uint32_t		magic;
+	uint32_t		version;
+	volatile uint32_t	seq;		/* odd while updating */
+	uint32_t		numservers;
+	double			offset;		/* estimated time offset (s) */
+	double			error;		/* error bound of offset (s) */
+	double			drift;		/* clock drift (PPM) */
+	int64_t			lastsync;	/* last successful poll cycle */
+	int64_t			lastupdate;
+	struct htpstatus_server	server[MAX_HTTP_HOSTS+1];
+};
+
+static struct htpstatus	*status = NULL;
+
+
+/* Measurement journal, a memory mapped file of fixed size records for
+   replay. Like the status page, the layout is part of the interface.
+*/
+#define	JOURNAL_POLL			1	/* a poll or burst probe */
+#define	JOURNAL_SAMPLE			2	/* offset interval to the combiner */
+#define	JOURNAL_CYCLE			3	/* combined offset of a cycle */
+
+struct journalrec {
+	uint8_t			type;
+	uint8_t			result;		/* error class, NUM_ERRORS if valid,
+						   samples in a cycle record */
+	uint16_t		server;		/* name table index, selected
+						   samples in a cycle record */
+	uint32_t		cycle;		/* poll cycle number */
+	int64_t			monosent;	/* monotonic clock (ns) */
+	int64_t			monoreceived;
+	int64_t			realsent;	/* local time (ns) */
+	int64_t			realreceived;
+	int64_t			date;		/* Date: header (s) */
+	int32_t			rtt;		/* round trip time (us) */
+	int32_t			bound;		/* error bound (us) */
+	int64_t			lower, upper;	/* offset interval (ns) */
+};
+
+struct journalhdr {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		recsize;
+	uint32_t		capacity;	/* records */
+	volatile uint32_t	count;		/* records written */
+	uint32_t		numservers;
+	char			server[JOURNAL_SERVERS][72];	/* host:port */
+};
+
+static struct {
+	char			*path;
+	struct journalhdr	*hdr;
+	struct journalrec	*rec;
+#ifndef DISABLE_THREADS
+	pthread_mutex_t		lock;
+} journal = { NULL, NULL, NULL, PTHREAD_MUTEX_INITIALIZER };
+#else
+} journal;
+#endif
+
+
+/* Make mktime timezone agnostic, see manpage timegm. Plain arithmetic
+   (days from civil), switching TZ is not thread safe.
+*/
+time_t gmtmktime (struct tm *tm)
+{
+	long y = tm->tm_year + 1900L, m = tm->tm_mon + 1, era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + tm->tm_mday - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return (time_t)(era * 146097 + doe - 719468) * 86400 + \
+	       tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
 }
 
 
+/* Interval edges, a start sorts before an end at the same offset */
+struct edge {
+	int64_t			offset;
+	int			type;		/* -1 start, +1 end */
+};
+
 /* Insertion sort is more efficient (and smaller) than qsort for small lists */
-static void insertsort( int a[], int length )
+static void insertsort( struct edge a[], int length )
 {
-	int i, j, value;
+	int i, j;
+	struct edge value;
 
 	for ( i = 1; i < length; i++ ) {
 		value = a[i];
-		for ( j = i - 1; j >= 0 && a[j] > value; j-- )
+		for ( j = i - 1; j >= 0 && ( a[j].offset > value.offset || \
+		      ( a[j].offset == value.offset && a[j].type > value.type ) ); j-- )
 			a[j+1] = a[j];
 		a[j+1] = value;
 	}
 }
 
 
+/* Marzullo's algorithm: the smallest interval [lo, hi] contained in the
+   largest number of sample intervals. Returns that number.
+*/
+static int marzullo( struct interval s[], int n, int64_t *lo, int64_t *hi )
+{
+	struct edge		edges[2 * sizeof(cycle.samples) / sizeof(cycle.samples[0])];
+	int			i, count = 0, best = 0;
+
+	for ( i = 0; i < n; i++ ) {
+		edges[2*i].offset = s[i].lower;
+		edges[2*i].type = -1;
+		edges[2*i+1].offset = s[i].upper;
+		edges[2*i+1].type = 1;
+	}
+	insertsort( edges, 2 * n );
+
+	for ( i = 0; i < 2 * n; i++ ) {
+		count -= edges[i].type;
+		if ( count > best ) {
+			best = count;
+			*lo = edges[i].offset;
+			*hi = edges[i+1].offset;
+		}
+	}
+
+	return( best );
+}
+
+
 /* Split argument in hostname/IP-address and TCP port
    Supports IPv6 literal addresses, RFC 2732.
 */
@@ -183,356 +600,4154 @@ static void splithostport( char **host, char **port )
 }
 
 
-/* Printlog is a slighty modified version from the one used in rdate */
-static void printlog( int is_error, char *format, ... )
+static void logwrite( int is_error, char *buf )
 {
-	va_list args;
-	char buf[128];
-
-	va_start(args, format);
-	(void) vsnprintf(buf, sizeof(buf), format, args);
-	va_end(args);
-
 	if ( logmode )
 		syslog(is_error?LOG_WARNING:LOG_INFO, "%s", buf);
 	else
-		fprintf(is_error?stderr:stdout, "%s\n", buf);
+		fprintf(is_error || output.format ? stderr : stdout, "%s\n", buf);
 }
 
 
-/* Drop or elevate privileges */
-static void swuid( int id )
+/* A log message as a key=value record for a long running htpdate, like
+   the sample dump. One-shot runs keep the plain text.
+*/
+static void logmessage( int is_error, char *msg )
 {
-	if ( seteuid( id ) ) {
-		printlog( 1, "seteuid() %i", id );
-		exit(1);
+	char			buf[2 * LOGLINESIZE + 32], *t;
+
+	if ( !logring.structured ) {
+		logwrite( is_error, msg );
+		return;
 	}
-}
-static void swgid( int id )
-{
-	if ( setegid( id ) ) {
-		printlog( 1, "setegid() %i", id );
-		exit(1);
+
+	t = buf + sprintf( buf, "event=log level=%s msg=\"", is_error ? "warning" : "info" );
+	for ( ; *msg; msg++ ) {
+		if ( *msg == '"' || *msg == '\\' )
+			*t++ = '\\';
+		*t++ = (unsigned char)*msg < 0x20 ? ' ' : *msg;
 	}
+	strcpy( t, "\"" );
+	logwrite( is_error, buf );
 }
 
-static int getHTTP (int server_s, char *buffer)
-{
-	int ret;
-
-	/* Send HEAD request */
-	ret = send(server_s, buffer, strlen(buffer), 0);
 
-	if (ret < 0) {
-		printlog( 1, "Error sending" );
-		return 0;
+/* Printlog is a slighty modified version from the one used in rdate.
+   Once the log writer runs, messages are queued instead of written.
+*/
+static void printlog( int is_error, char *format, ... ) __attribute__ ((format (printf, 2, 3)));
+static void printlog( int is_error, char *format, ... )
+{
+	va_list args;
+	char buf[LOGLINESIZE], *line = buf;
+	unsigned head = 0;
+	int len;
+
+	if ( logring.running ) {
+		do {
+			head = logring.head;
+			if ( head - logring.tail >= LOGRINGSIZE ) {
+				__sync_fetch_and_add( &logring.dropped, 1 );
+				return;
+			}
+		} while ( !__sync_bool_compare_and_swap( &logring.head, head, head + 1 ) );
+		line = logring.line[head & (LOGRINGSIZE - 1)];
 	}
 
-	/* Receive data from the web server
-	   The return code from recv() is the number of bytes received
-	*/
-	ret = recv(server_s, buffer, BUFFERSIZE - 1, 0) != -1;
+	va_start(args, format);
+	len = vsnprintf(line, LOGLINESIZE, format, args);
+	va_end(args);
 
-	close( server_s );
+	/* Mark truncated messages */
+	if ( len >= LOGLINESIZE )
+		strcpy( line + LOGLINESIZE - 4, "..." );
 
-	return ret;
+	if ( !logring.running ) {
+		logmessage( is_error, line );
+		return;
+	}
+
+	logring.is_error[head & (LOGRINGSIZE - 1)] = is_error;
+	__sync_synchronize();
+	logring.ready[head & (LOGRINGSIZE - 1)] = 1;
+#ifndef DISABLE_THREADS
+	sem_post( &logring.sem );
+#endif
 }
 
-#ifdef ENABLE_HTTPS
-static int getHTTPS (int server_s, char *buffer)
+
+/* Keep a measurement record, overwriting the oldest */
+static void logsample( char *host, char *port, long rtt, double offset, int err )
 {
-	int ret;
-	SSL_CTX *ssl_ctx = SSL_CTX_new (TLS_method());
+	struct samplerecord	*rec;
+
+	rec = &samplering.rec[__sync_fetch_and_add( &samplering.count, 1 ) % SAMPLERINGSIZE];
+	gettimeofday( &rec->time, NULL );
+	snprintf( rec->host, sizeof(rec->host), "%s", host );
+	snprintf( rec->port, sizeof(rec->port), "%s", port );
+	rec->rtt = rtt;
+	rec->offset = offset;
+	rec->err = err;
+}
 
-	SSL *conn = SSL_new(ssl_ctx);
-	SSL_set_fd(conn, server_s);
 
-	int err = SSL_connect(conn);
-	if (err != 1)
-		return 0;
+/* Write the last measurement records as key=value lines */
+static void sampledump( void )
+{
+	struct samplerecord	*rec;
+	struct tm		tm;
+	char			buf[LOGLINESIZE], ts[32];
+	unsigned		i, n;
+
+	n = samplering.count;
+	snprintf( buf, sizeof(buf), "event=dump samples=%u", \
+	          n < SAMPLERINGSIZE ? n : SAMPLERINGSIZE );
+	logwrite( 0, buf );
+
+	for ( i = n < SAMPLERINGSIZE ? 0 : n - SAMPLERINGSIZE; i < n; i++ ) {
+		rec = &samplering.rec[i % SAMPLERINGSIZE];
+		gmtime_r( &rec->time.tv_sec, &tm );
+		strftime( ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm );
+		snprintf( buf, sizeof(buf), "event=sample time=%s.%06ldZ host=%s " \
+		          "port=%s rtt=%.6f offset=%.6f result=%s", ts, \
+		          (long)rec->time.tv_usec, rec->host, rec->port, \
+		          rec->rtt * 1e-6, rec->offset, \
+		          rec->err < NUM_ERRORS ? errorname[rec->err] : "ok" );
+		logwrite( 0, buf );
+	}
+}
 
-	ret = SSL_write(conn, buffer, BUFFERSIZE -1);
 
-	if (ret <= 0) {
-		printlog( 1, "Error sending" );
-		return 0;
+/* Map a journal file, a new one or an existing one to append to */
+static int journal_map( int create )
+{
+	size_t			size = sizeof(struct journalhdr) + \
+				       JOURNAL_RECORDS * sizeof(struct journalrec);
+	struct stat		st;
+	void			*p;
+	int			fd;
+
+	fd = open( journal.path, O_RDWR | O_CREAT | O_CLOEXEC | (create ? O_TRUNC : 0), 0644 );
+	if ( fd < 0 || fstat( fd, &st ) ) {
+		printlog( 1, "Error opening journal %s", journal.path );
+		return(-1);
+	}
+	if ( st.st_size != 0 && (size_t)st.st_size != size ) {
+		printlog( 1, "%s is not an htpdate journal", journal.path );
+		close( fd );
+		return(-1);
+	}
+	if ( ftruncate( fd, size ) ) {
+		printlog( 1, "Error sizing journal %s", journal.path );
+		close( fd );
+		return(-1);
 	}
 
-	ret = SSL_read(conn, buffer, BUFFERSIZE - 1) > 0;
+	p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( p == MAP_FAILED ) {
+		printlog( 1, "mmap() journal %s", journal.path );
+		return(-1);
+	}
 
-	SSL_shutdown(conn);
+	journal.hdr = p;
+	journal.rec = (struct journalrec *)( journal.hdr + 1 );
+	if ( st.st_size == 0 || create ) {
+		journal.hdr->magic = JOURNAL_MAGIC;
+		journal.hdr->version = JOURNAL_VERSION;
+		journal.hdr->recsize = sizeof(struct journalrec);
+		journal.hdr->capacity = JOURNAL_RECORDS;
+	} else if ( journal.hdr->magic != JOURNAL_MAGIC || \
+	            journal.hdr->version != JOURNAL_VERSION || \
+	            journal.hdr->recsize != sizeof(struct journalrec) ) {
+		printlog( 1, "%s is not an htpdate journal", journal.path );
+		munmap( p, size );
+		journal.hdr = NULL;
+		return(-1);
+	}
 
-	return ret;
+	return(0);
 }
-#endif
 
-static long getHTTPdate( char *host, char *port, char *proxy, char *proxyport, char *httpversion, int ipversion, int when )
+/* Cycle numbers go on from the last record, replay groups records by
+   cycle and a journal spans restarts
+*/
+static int journal_open( char *path )
 {
-	int			server_s;
-	int			rc;
-	struct addrinfo		hints, *res, *res0;
-	struct tm		tm;
-	struct timeval		timevalue = {LONG_MAX, 0};
-	struct timeval		timeofday;
-	struct timespec		sleepspec, remainder;
-	long			rtt;
-	char			buffer[BUFFERSIZE] = { '\0' };
-	char			remote_time[25] = { '\0' };
-	char			url[URLSIZE] = { '\0' };
-	char			*pdate = NULL;
+	journal.path = path;
+	if ( journal_map( 0 ) < 0 )
+		return(-1);
+	if ( journal.hdr->count )
+		cycle.id = journal.rec[journal.hdr->count - 1].cycle;
+	return(0);
+}
 
-#ifdef ENABLE_HTTPS
-	int			port_is_https = 0;
 
-	if (strncmp (port, "443", 3) == 0)
-		port_is_https = 1;
-#endif
+/* A full journal is renamed to <path>.1, replacing the previous one */
+static void journal_rotate( void )
+{
+	char			old[PATH_MAX];
+
+	snprintf( old, sizeof(old), "%s.1", journal.path );
+	munmap( journal.hdr, sizeof(struct journalhdr) + \
+	        JOURNAL_RECORDS * sizeof(struct journalrec) );
+	journal.hdr = NULL;
+	if ( rename( journal.path, old ) || journal_map( 1 ) < 0 )
+		printlog( 1, "Journal rotation failed, journal stopped" );
+}
 
-	/* Connect to web server via proxy server or directly */
-	memset( &hints, 0, sizeof(hints) );
-	switch( ipversion ) {
-	case 4:					/* IPv4 only */
-		hints.ai_family = AF_INET;
-		break;
-	case 6:					/* IPv6 only */
-		hints.ai_family = AF_INET6;
-		break;
-	default:				/* Support IPv6 and IPv4 name resolution */
-		hints.ai_family = PF_UNSPEC;
-	}
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_CANONNAME;
 
-	if ( proxy == NULL ) {
-		rc = getaddrinfo( host, port, &hints, &res0 );
-	} else {
-		snprintf( url, URLSIZE, "http://%s:%s", host, port);
-		rc = getaddrinfo( proxy, proxyport, &hints, &res0 );
-	}
+/* Index in the name table of the journal */
+static int journal_server( struct server *srv )
+{
+	struct journalhdr	*hdr = journal.hdr;
+	char			name[sizeof(hdr->server[0])];
+	unsigned		i;
+
+	snprintf( name, sizeof(name), "%s:%s%s%s", srv->host, srv->port, \
+	          *srv->path ? "@" : "", srv->path );
+	for ( i = 0; i < hdr->numservers; i++ )
+		if ( strcmp( hdr->server[i], name ) == 0 )
+			return(i);
+	if ( hdr->numservers == JOURNAL_SERVERS )
+		return(0xffff);
+	strcpy( hdr->server[hdr->numservers], name );
+	return( hdr->numservers++ );
+}
 
-	/* Was the hostname and service resolvable? */
-	if ( rc ) {
-		printlog( 1, "%s host or service unavailable", host );
-		return(0);				/* Assume correct time */
-	}
 
-	/* Build a combined HTTP/1.0 and 1.1 HEAD request
-	   Pragma: no-cache, "forces" an HTTP/1.0 and 1.1 compliant
-	   web server to return a fresh timestamp
-	   Connection: close, allows the server the immediately close the
-	   connection after sending the response.
-	*/
-	snprintf(buffer, BUFFERSIZE, "HEAD %s/ HTTP/1.%s\r\nHost: %s\r\nUser-Agent: htpdate/"VERSION"\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n", url, httpversion, host);
+/* Append a record, the count is updated after the record is complete */
+static void journal_write( struct journalrec *rec, struct server *srv )
+{
+	if ( journal.path == NULL )
+		return;
 
-	/* Loop through the available canonical names */
-	res = res0;
-	do {
-		server_s = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
-		if ( server_s < 0 ) {
-			continue;
-		}
+#ifndef DISABLE_THREADS
+	pthread_mutex_lock( &journal.lock );
+#endif
+	if ( journal.hdr && journal.hdr->count == journal.hdr->capacity )
+		journal_rotate();
+	if ( journal.hdr ) {
+		rec->cycle = cycle.id;
+		if ( srv )
+			rec->server = journal_server( srv->parent ? srv->parent : srv );
+		journal.rec[journal.hdr->count] = *rec;
+		__sync_synchronize();
+		journal.hdr->count++;
+	}
+#ifndef DISABLE_THREADS
+	pthread_mutex_unlock( &journal.lock );
+#endif
+}
 
-		rc = connect( server_s, res->ai_addr, res->ai_addrlen );
-		if ( rc ) {
-			close( server_s);
-			server_s = -1;
-			continue;
-		}
 
-		break;
-	} while ( ( res = res->ai_next ) );
+/* Journal a poll: what was sent and received when, and the outcome */
+static void journal_poll( struct server *srv, struct timeval *sent, \
+                          struct timeval *received, time_t date, long rtt )
+{
+	struct journalrec	rec;
 
-	freeaddrinfo(res0);
+	if ( journal.path == NULL )
+		return;
 
-	if ( rc ) {
-		printlog( 1, "%s connection failed", host );
-		return(0);				/* Assume correct time */
+	memset( &rec, 0, sizeof(rec) );
+	rec.type = JOURNAL_POLL;
+	rec.result = srv->lasterror;
+	rec.monosent = (int64_t)( srv->sent * 1e9 );
+	rec.monoreceived = (int64_t)( srv->firstbyte * 1e9 );
+	if ( sent )
+		rec.realsent = (int64_t)sent->tv_sec * 1000000000 + sent->tv_usec * 1000;
+	if ( received )
+		rec.realreceived = (int64_t)received->tv_sec * 1000000000 + \
+		                   received->tv_usec * 1000;
+	rec.date = date;
+	rec.rtt = rtt;
+	if ( srv->lasterror == NUM_ERRORS ) {
+		rec.bound = srv->bound;
+		rec.lower = srv->sample.lower;
+		rec.upper = srv->sample.upper;
 	}
+	journal_write( &rec, srv );
+}
 
-	/* Initialize timer */
-	gettimeofday(&timeofday, NULL);
 
-	/* Initialize RTT (start of measurement) */
-	rtt = timeofday.tv_sec;
+/* Journal the combined offset of a poll cycle */
+static void journal_cycle( int validtimes, int goodtimes, int64_t lo, int64_t hi )
+{
+	struct journalrec	rec;
+	struct timeval		now;
 
-	/* Wait till we reach the desired time, "when" */
-	sleepspec.tv_sec = 0;
-	if ( when >= timeofday.tv_usec ) {
-		sleepspec.tv_nsec = ( when - timeofday.tv_usec ) * 1000;
-	} else {
-		sleepspec.tv_nsec = ( 1000000 + when - timeofday.tv_usec ) * 1000;
-		rtt++;
-	}
-	nanosleep( &sleepspec, &remainder );
+	if ( journal.path == NULL )
+		return;
 
-#ifdef ENABLE_HTTPS
-	if (port_is_https)
-		rc = getHTTPS(server_s, buffer);
-	else
-#endif
-		rc = getHTTP(server_s, buffer);
+	ops->gettime( &now );
+	memset( &rec, 0, sizeof(rec) );
+	rec.type = JOURNAL_CYCLE;
+	rec.result = validtimes;
+	rec.server = goodtimes;
+	rec.realreceived = (int64_t)now.tv_sec * 1000000000 + now.tv_usec * 1000;
+	rec.lower = lo;
+	rec.upper = hi;
+	journal_write( &rec, NULL );
+}
 
-	if ( !rc )
-		printlog( 1, "error getting data from %s:%s", host, port );
 
-	if ( rc ) {
-		/* Assuming that network delay (server->htpdate) is neglectable,
-		   the received web server time "should" match the local time.
+#ifndef DISABLE_THREADS
+/* Log writer thread, drains the ring buffer */
+static void *logwriter( void *arg )
+{
+	unsigned		slot;
+	unsigned long		dropped;
+	char			buf[64];
+
+	for (;;) {
+		while ( sem_wait( &logring.sem ) && errno == EINTR );
+
+		while ( logring.tail != logring.head ) {
+			slot = logring.tail & (LOGRINGSIZE - 1);
+			/* Producer still busy, it will post again */
+			if ( !logring.ready[slot] )
+				break;
+			logmessage( logring.is_error[slot], logring.line[slot] );
+			logring.ready[slot] = 0;
+			__sync_synchronize();
+			logring.tail++;
+		}
 
-		   From RFC 2616 paragraph 14.18
-		   ...
-		   It SHOULD represent the best available approximation
-		   of the date and time of message generation, unless the
-		   implementation has no means of generating a reasonably
-		   accurate date and time.
-		   ...
-		*/
+		if ( (dropped = logring.dropped) ) {
+			__sync_fetch_and_sub( &logring.dropped, dropped );
+			if ( logring.structured )
+				snprintf( buf, sizeof(buf), "event=dropped messages=%lu", dropped );
+			else
+				snprintf( buf, sizeof(buf), "%lu log messages dropped", dropped );
+			logwrite( 1, buf );
+		}
 
-		gettimeofday(&timeofday, NULL);
+		if ( logring.dump ) {
+			logring.dump = 0;
+			sampledump();
+		}
 
-		/* rtt contains round trip time in micro seconds, now! */
-		rtt = ( timeofday.tv_sec - rtt ) * 1000000 + \
-		      timeofday.tv_usec - when;
+		if ( logring.stop && logring.tail == logring.head )
+			break;
+	}
 
-		/* Look for the line that contains Date: */
-		if ( ((pdate = strstr(buffer, "Date: ")) != NULL ||
-		      (pdate = strstr(buffer, "date: ")) != NULL) &&
-		     strlen( pdate ) >= 35 ) {
-			strncpy(remote_time, pdate + 11, 24);
+	if ( !logmode )
+		fflush( stdout );
 
-			memset(&tm, 0, sizeof(struct tm));
-			if ( strptime( remote_time, "%d %b %Y %T", &tm) != NULL) {
-				timevalue.tv_sec = gmtmktime(&tm);
-			} else {
-				printlog( 1, "%s unknown time format", host );
-			}
+	return(NULL);
+}
 
-			/* Print host, raw timestamp, round trip time */
-			if ( debug )
-				printlog( 0, "%-25s %s %s (%.3f) => %li", host, port, remote_time, \
-				          rtt * 1e-6, timevalue.tv_sec - timeofday.tv_sec );
 
-		} else {
-			printlog( 1, "%s no timestamp", host );
-		}
+/* Flush the ring buffer and stop the log writer, at exit */
+static void log_stop( void )
+{
+	if ( !logring.running )
+		return;
 
-	}						/* bytes received */
+	logring.stop = 1;
+	sem_post( &logring.sem );
+	pthread_join( logring.writer, NULL );
+	logring.running = 0;
+}
 
-	/* Return the time delta between web server time (timevalue)
-	   and system time (timeofday)
-	*/
-	return( timevalue.tv_sec - timeofday.tv_sec );
 
+static void log_dumpsignal( int sig )
+{
+	logring.dump = 1;
+	sem_post( &logring.sem );
 }
 
 
-static int setclock( double timedelta, int setmode )
+static void log_start( int structured )
+{
+	logring.structured = structured;
+	if ( sem_init( &logring.sem, 0, 0 ) || \
+	     pthread_create( &logring.writer, NULL, logwriter, NULL ) ) {
+		printlog( 1, "Error starting log writer" );
+		return;
+	}
+	logring.running = 1;
+	atexit( log_stop );
+	signal( SIGUSR1, log_dumpsignal );
+}
+#else
+/* Without threads messages are written right away */
+static void log_dumpsignal( int sig )
+{
+	logring.dump = 1;
+}
+
+
+static void log_start( int structured )
+{
+	logring.structured = structured;
+	signal( SIGUSR1, log_dumpsignal );
+}
+#endif
+
+
+/* Monotonic time in seconds, for measuring durations */
+static double monotime( void )
+{
+	struct timespec		ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return( ts.tv_sec + ts.tv_nsec * 1e-9 );
+}
+
+
+/* May the clock be changed, as root or with CAP_SYS_TIME (Linux) */
+static int cansettime( void )
+{
+#ifdef __linux__
+	struct __user_cap_header_struct	caphdr = { _LINUX_CAPABILITY_VERSION_3, 0 };
+	struct __user_cap_data_struct	cap[2];
+
+	if ( geteuid() != 0 && syscall( SYS_capget, &caphdr, cap ) == 0 )
+		return( (cap[0].effective >> CAP_SYS_TIME) & 1 );
+#endif
+	return( geteuid() == 0 );
+}
+
+
+/* Keep CAP_SYS_TIME only, if we have it (Linux) */
+static int limitcaps( void )
+{
+#ifdef __linux__
+	struct __user_cap_header_struct	caphdr = { _LINUX_CAPABILITY_VERSION_3, 0 };
+	struct __user_cap_data_struct	cap[2];
+	unsigned			keep;
+
+	if ( syscall( SYS_capget, &caphdr, cap ) < 0 )
+		return(-1);
+	keep = cap[0].permitted & (1 << CAP_SYS_TIME);
+	memset( cap, 0, sizeof(cap) );
+	cap[0].effective = cap[0].permitted = keep;
+	if ( syscall( SYS_capset, &caphdr, cap ) < 0 )
+		return(-1);
+	prctl( PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0 );
+#endif
+	return(0);
+}
+
+
+/* Drop root privileges for good, root can't be regained */
+static void dropprivs( int uid, int gid )
+{
+#ifdef SIMULATOR
+	/* The virtual clock needs no privileges */
+	return;
+#endif
+	if ( setgroups( 0, NULL ) || setgid( gid ) ) {
+		printlog( 1, "setgid() %i", gid );
+		exit(1);
+	}
+	if ( setuid( uid ) ) {
+		printlog( 1, "setuid() %i", uid );
+		exit(1);
+	}
+}
+
+/* Account a failed poll */
+static void srverror( struct server *srv, int err )
+{
+	srv->failures++;
+	srv->errors[err]++;
+	srv->lasterror = err;
+	logsample( srv->host, srv->port, 0, 0, err );
+}
+
+
+/* Account the round trip time of a successful poll */
+static void srvrtt( struct server *srv, long rtt )
+{
+	int			i;
+
+	srv->rtt = rtt;
+	srv->rttsum += rtt * 1e-6;
+	for ( i = 0; i < RTT_BUCKETS - 1 && rtt > rttbucket[i]; i++ );
+	srv->rtthist[i]++;
+}
+
+
+/* Smoothed round trip time of the TCP connection, by the kernel */
+static long tcpinfortt( int server_s )
+{
+#ifdef TCP_INFO
+	struct tcp_info		info;
+	socklen_t		len = sizeof(info);
+
+	if ( getsockopt( server_s, IPPROTO_TCP, TCP_INFO, &info, &len ) == 0 )
+		return( info.tcpi_rtt );
+#endif
+	return(0);
+}
+
+
+static int getHTTP (struct server *srv, int server_s, char *buffer)
+{
+	int ret;
+
+	/* Send HEAD request, with TCP Fast Open in the SYN. The send then
+	   returns after the handshake, when the web server may have stamped
+	   its response already, so take the time before.
+	*/
+	srv->sent = monotime();
+	ret = send(server_s, buffer, strlen(buffer), 0);
+
+	if (ret < 0) {
+		printlog( 1, "Error sending" );
+		close( server_s );
+		return 0;
+	}
+
+	/* Receive data from the web server
+	   The return code from recv() is the number of bytes received
+	*/
+	ret = recv(server_s, buffer, BUFFERSIZE - 1, 0) != -1;
+	srv->firstbyte = monotime();
+	srv->tcprtt = tcpinfortt( server_s );
+
+	close( server_s );
+
+	return ret;
+}
+
+#ifdef ENABLE_HTTPS
+/* TLS client connections, on a connected socket. The measurement code only
+   uses these, the backend is OpenSSL or (TLS_MBEDTLS) mbedTLS. Certificates
+   are not verified: the time isn't known yet to check their validity.
+*/
+struct tlsconn;
+
+static int tls_init( void );
+static struct tlsconn *tls_connect( int fd, char *host, int h2 );
+static int tls_h2( struct tlsconn *c );
+static int tls_read( struct tlsconn *c, void *buf, int len );
+static int tls_write( struct tlsconn *c, const void *buf, int len );
+static int tls_pending( struct tlsconn *c );
+static int tls_fd( struct tlsconn *c );
+static void tls_close( struct tlsconn *c );
+
+#ifdef TLS_MBEDTLS
+struct tlsconn {
+	mbedtls_ssl_context	ssl;
+	int			fd;
+};
+
+/* Shared and read-only once set up, one offers h2 by ALPN */
+static mbedtls_ssl_config	tlsconf, tlsconfh2;
+
+/* Random numbers from the kernel, thread safe without a DRBG */
+static int tls_random( void *arg, unsigned char *buf, size_t len )
+{
+	size_t			n;
+
+	for ( ; len > 0; buf += n, len -= n ) {
+		n = len > 256 ? 256 : len;
+		if ( getentropy( buf, n ) )
+			return(-1);
+	}
+	return(0);
+}
+
+static int tls_send( void *ctx, const unsigned char *buf, size_t len )
+{
+	int			ret;
+
+	while ( (ret = send( *(int *)ctx, buf, len, MSG_NOSIGNAL )) < 0 && errno == EINTR );
+	return( ret < 0 ? MBEDTLS_ERR_NET_SEND_FAILED : ret );
+}
+
+static int tls_recv( void *ctx, unsigned char *buf, size_t len )
+{
+	int			ret;
+
+	while ( (ret = recv( *(int *)ctx, buf, len, 0 )) < 0 && errno == EINTR );
+	return( ret < 0 ? MBEDTLS_ERR_NET_RECV_FAILED : ret );
+}
+
+static int tls_conf( mbedtls_ssl_config *conf )
+{
+	mbedtls_ssl_config_init( conf );
+	if ( mbedtls_ssl_config_defaults( conf, MBEDTLS_SSL_IS_CLIENT, \
+	     MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT ) )
+		return(-1);
+	mbedtls_ssl_conf_authmode( conf, MBEDTLS_SSL_VERIFY_NONE );
+	mbedtls_ssl_conf_rng( conf, tls_random, NULL );
+	return(0);
+}
+
+static int tls_init( void )
+{
+	static const char	*alpn[] = { "h2", "http/1.1", NULL };
+
+#ifdef MBEDTLS_PSA_CRYPTO_C
+	if ( psa_crypto_init() != PSA_SUCCESS )
+		return(-1);
+#endif
+	if ( tls_conf( &tlsconf ) || tls_conf( &tlsconfh2 ) || \
+	     mbedtls_ssl_conf_alpn_protocols( &tlsconfh2, alpn ) )
+		return(-1);
+	return(0);
+}
+
+static struct tlsconn *tls_connect( int fd, char *host, int h2 )
+{
+	struct tlsconn		*c;
+	int			ret;
+
+	if ( (c = malloc( sizeof(*c) )) == NULL )
+		return(NULL);
+	c->fd = fd;
+	mbedtls_ssl_init( &c->ssl );
+	if ( mbedtls_ssl_setup( &c->ssl, h2 ? &tlsconfh2 : &tlsconf ) || \
+	     mbedtls_ssl_set_hostname( &c->ssl, host ) ) {
+		mbedtls_ssl_free( &c->ssl );
+		free( c );
+		return(NULL);
+	}
+	mbedtls_ssl_set_bio( &c->ssl, &c->fd, tls_send, tls_recv, NULL );
+
+	while ( (ret = mbedtls_ssl_handshake( &c->ssl )) == MBEDTLS_ERR_SSL_WANT_READ || \
+	        ret == MBEDTLS_ERR_SSL_WANT_WRITE );
+	if ( ret ) {
+		mbedtls_ssl_free( &c->ssl );
+		free( c );
+		return(NULL);
+	}
+	return(c);
+}
+
+static int tls_h2( struct tlsconn *c )
+{
+	const char		*proto = mbedtls_ssl_get_alpn_protocol( &c->ssl );
+
+	return( proto != NULL && strcmp( proto, "h2" ) == 0 );
+}
+
+static int tls_read( struct tlsconn *c, void *buf, int len )
+{
+	int			ret;
+
+	do {
+		ret = mbedtls_ssl_read( &c->ssl, buf, len );
+	} while ( ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+	          || ret == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+#endif
+	        );
+	return( ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY ? 0 : ret );
+}
+
+/* Like SSL_write, all or nothing */
+static int tls_write( struct tlsconn *c, const void *buf, int len )
+{
+	int			n, ret;
+
+	for ( n = 0; n < len; n += ret ) {
+		ret = mbedtls_ssl_write( &c->ssl, (const unsigned char *)buf + n, len - n );
+		if ( ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE )
+			ret = 0;
+		else if ( ret < 0 )
+			return(-1);
+	}
+	return(len);
+}
+
+static int tls_pending( struct tlsconn *c )
+{
+	return( mbedtls_ssl_get_bytes_avail( &c->ssl ) > 0 );
+}
+
+static int tls_fd( struct tlsconn *c )
+{
+	return( c->fd );
+}
+
+static void tls_close( struct tlsconn *c )
+{
+	mbedtls_ssl_close_notify( &c->ssl );
+	mbedtls_ssl_free( &c->ssl );
+	close( c->fd );
+	free( c );
+}
+
+#else
+struct tlsconn {
+	SSL			*ssl;
+};
+
+/* One SSL context, shared by the workers and burst probes. It isn't
+   changed once set up, SSL_new() on it is thread safe.
+*/
+static SSL_CTX		*ssl_ctx;
+
+static int tls_init( void )
+{
+	SSL_load_error_strings ();
+	SSL_library_init ();
+	ssl_ctx = SSL_CTX_new (TLS_method());
+	return(ssl_ctx == NULL ? -1 : 0);
+}
+
+static struct tlsconn *tls_connect( int fd, char *host, int h2 )
+{
+	static const unsigned char alpn[] = "\x02h2\x08http/1.1";
+	struct tlsconn *c;
+
+	if ((c = malloc(sizeof(*c))) == NULL)
+		return NULL;
+
+	c->ssl = SSL_new(ssl_ctx);
+	SSL_set_fd(c->ssl, fd);
+	SSL_set_tlsext_host_name(c->ssl, host);
+	if (h2)
+		SSL_set_alpn_protos(c->ssl, alpn, sizeof(alpn) - 1);
+	if (SSL_connect(c->ssl) != 1) {
+		SSL_free(c->ssl);
+		free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+static int tls_h2( struct tlsconn *c )
+{
+	const unsigned char *proto;
+	unsigned protolen;
+
+	SSL_get0_alpn_selected(c->ssl, &proto, &protolen);
+	return protolen == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+static int tls_read( struct tlsconn *c, void *buf, int len )
+{
+	return SSL_read(c->ssl, buf, len);
+}
+
+static int tls_write( struct tlsconn *c, const void *buf, int len )
+{
+	return SSL_write(c->ssl, buf, len);
+}
+
+static int tls_pending( struct tlsconn *c )
+{
+	return SSL_pending(c->ssl);
+}
+
+static int tls_fd( struct tlsconn *c )
+{
+	return SSL_get_fd(c->ssl);
+}
+
+static void tls_close( struct tlsconn *c )
+{
+	int fd = SSL_get_fd(c->ssl);
+
+	SSL_shutdown(c->ssl);
+	SSL_free(c->ssl);
+	close(fd);
+	free(c);
+}
+#endif
+
+
+static int getHTTPS (struct server *srv, int server_s, char *buffer)
+{
+	int ret;
+	struct tlsconn *conn = tls_connect(server_s, srv->host, 0);
+
+	if (conn == NULL) {
+		close( server_s );
+		return -1;
+	}
+
+	ret = tls_write(conn, buffer, strlen(buffer));
+	srv->sent = monotime();
+
+	if (ret <= 0) {
+		printlog( 1, "Error sending" );
+		tls_close(conn);
+		return 0;
+	}
+
+	ret = tls_read(conn, buffer, BUFFERSIZE - 1) > 0;
+	srv->firstbyte = monotime();
+	srv->tcprtt = tcpinfortt( server_s );
+
+	tls_close(conn);
+
+	return ret;
+}
+#endif
+
+static int ishttps( struct server *srv )
+{
+	return( strncmp (srv->port, "443", 3) == 0 );
+}
+
+
+/* HTTPS via a proxy server goes through a CONNECT tunnel */
+static int tunneled( struct server *srv, char *proxy )
+{
+#ifdef ENABLE_HTTPS
+	return( proxy != NULL && ishttps( srv ) );
+#else
+	return( 0 );
+#endif
+}
+
+
+/* Connections kept open between polls, CONNECT tunnels and HTTP/2 */
+static int persistent( struct server *srv, char *proxy )
+{
+	return( tunneled( srv, proxy ) || (http2 && proxy == NULL && ishttps( srv )) );
+}
+
+
+/* Name lookups are cached for an hour, or until a connect fails */
+static int srvresolve( struct server *srv, char *proxy, char *proxyport, int ipversion )
+{
+	char			*host = srv->host, *port = srv->port;
+	int			rc = 0;
+	struct addrinfo		hints;
+	time_t			now = time(NULL);
+
+	memset( &hints, 0, sizeof(hints) );
+	switch( ipversion ) {
+	case 4:					/* IPv4 only */
+		hints.ai_family = AF_INET;
+		break;
+	case 6:					/* IPv6 only */
+		hints.ai_family = AF_INET6;
+		break;
+	default:				/* Support IPv6 and IPv4 name resolution */
+		hints.ai_family = PF_UNSPEC;
+	}
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_CANONNAME;
+
+	if ( srv->addr && now - srv->resolved > DNS_TTL ) {
+		freeaddrinfo( srv->addr );
+		srv->addr = NULL;
+	}
+
+	if ( srv->addr == NULL ) {
+		if ( proxy == NULL ) {
+			rc = getaddrinfo( host, port, &hints, &srv->addr );
+		} else {
+			rc = getaddrinfo( proxy, proxyport, &hints, &srv->addr );
+		}
+		srv->resolved = now;
+	}
+
+	/* Was the hostname and service resolvable? */
+	if ( rc ) {
+		printlog( 1, "%s host or service unavailable", host );
+		srv->addr = NULL;
+		srverror( srv, ERR_DNS );
+		return(-1);
+	}
+
+	return(0);
+}
+
+
+/* The path of a web server, after a '@': the source address (src=),
+   interface (dev=) and firewall mark (mark=) of its connections,
+   separated by commas. Eg. www.example.com@dev=eth1,src=192.0.2.1
+*/
+static int pathparse( struct server *srv, char *path )
+{
+	struct addrinfo		hints;
+	char			*dup, *opt, *value, *end;
+
+	srv->path = path;
+	if ( *path == '\0' )
+		return(0);
+
+	dup = strdup( path );
+	for ( opt = strtok( dup, "," ); opt; opt = strtok( NULL, "," ) ) {
+		if ( (value = strchr( opt, '=' )) == NULL )
+			break;
+		*value++ = '\0';
+		if ( strcmp( opt, "src" ) == 0 ) {
+			memset( &hints, 0, sizeof(hints) );
+			hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+			hints.ai_socktype = SOCK_STREAM;
+			if ( getaddrinfo( value, NULL, &hints, &srv->src ) )
+				break;
+#ifdef SO_BINDTODEVICE
+		} else if ( strcmp( opt, "dev" ) == 0 && strlen( value ) < IFNAMSIZ ) {
+			strcpy( srv->dev, value );
+#endif
+#ifdef SO_MARK
+		} else if ( strcmp( opt, "mark" ) == 0 ) {
+			srv->mark = strtoul( value, &end, 0 );
+			if ( *end != '\0' || srv->mark == 0 )
+				break;
+#endif
+		} else
+			break;
+	}
+	free( dup );
+
+	if ( opt ) {
+		printlog( 1, "%s invalid or unsupported path %s", srv->host, path );
+		if ( srv->src )
+			freeaddrinfo( srv->src );
+		srv->src = NULL;
+		return(-1);
+	}
+	return(0);
+}
+
+
+/* Bind a socket to the path of the web server. Fails when the source
+   address is of another address family.
+*/
+static int pathbind( struct server *srv, int fd, int family )
+{
+	if ( srv->src ) {
+		if ( srv->src->ai_family != family )
+			return(-1);
+		if ( bind( fd, srv->src->ai_addr, srv->src->ai_addrlen ) ) {
+			printlog( 1, "%s bind to source address failed", srv->host );
+			return(-1);
+		}
+	}
+#ifdef SO_BINDTODEVICE
+	if ( srv->dev[0] && setsockopt( fd, SOL_SOCKET, SO_BINDTODEVICE, \
+	                                srv->dev, strlen( srv->dev ) ) ) {
+		printlog( 1, "%s bind to interface %s failed", srv->host, srv->dev );
+		return(-1);
+	}
+#endif
+#ifdef SO_MARK
+	if ( srv->mark && setsockopt( fd, SOL_SOCKET, SO_MARK, \
+	                              &srv->mark, sizeof(srv->mark) ) ) {
+		printlog( 1, "%s setting firewall mark failed", srv->host );
+		return(-1);
+	}
+#endif
+	return(0);
+}
+
+
+/* Tune a probe socket: no delayed sends or acks, and close with a reset
+   so sweeps of many web servers don't leave sockets in TIME_WAIT. Connect,
+   send and receive time out, a dead web server or reused connection
+   doesn't stall the poll loop until TCP gives up. A HEAD
+   request and the part of the response we read fit in small buffers, TLS
+   handshakes don't. With TCP Fast Open (-f) the connect is deferred and
+   the request goes out in the SYN; not through a proxy, its connect time
+   is needed. Returns 1 for a deferred connect.
+*/
+static int sockopts( struct server *srv, int fd, char *proxy )
+{
+	struct linger		lin = { 1, 0 };
+	struct timeval		tv = { IO_TIMEOUT, 0 };
+	int			on = 1, size = BUFFERSIZE;
+#ifdef TCP_USER_TIMEOUT
+	unsigned		ms = IO_TIMEOUT * 1000;
+
+	setsockopt( fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms) );
+#endif
+	/* On Linux the send timeout bounds the connect too */
+	setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+	setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+#ifdef TCP_QUICKACK
+	setsockopt( fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on) );
+#endif
+	setsockopt( fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin) );
+	if ( ishttps( srv ) )
+		return(0);
+
+	setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+	setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+#ifdef TCP_FASTOPEN_CONNECT
+	if ( fastopen && proxy == NULL && \
+	     setsockopt( fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on) ) == 0 )
+		return(1);
+#endif
+	return(0);
+}
+
+
+/* Connect to the web server, via the proxy server or directly. Burst
+   probes use the name lookup of the web server they were copied from.
+*/
+static int sockconnect( struct server *srv, char *proxy, char *proxyport, int ipversion )
+{
+	int			server_s = -1;
+	int			rc = 0, deferred;
+	struct addrinfo		*res;
+
+	if ( srv->parent == NULL && srvresolve( srv, proxy, proxyport, ipversion ) )
+		return(-1);
+
+	/* Loop through the available canonical names */
+	res = srv->addr;
+	do {
+		server_s = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
+		if ( server_s < 0 ) {
+			continue;
+		}
+
+		deferred = sockopts( srv, server_s, proxy );
+		if ( pathbind( srv, server_s, res->ai_family ) ) {
+			close( server_s );
+			server_s = -1;
+			rc = -1;
+			continue;
+		}
+
+		srv->connrtt = -(long)(monotime() * 1e6);
+		rc = connect( server_s, res->ai_addr, res->ai_addrlen );
+		srv->connrtt += (long)(monotime() * 1e6);
+		if ( rc ) {
+			close( server_s);
+			server_s = -1;
+			continue;
+		}
+		if ( deferred )
+			srv->connrtt = 0;
+		getnameinfo( res->ai_addr, res->ai_addrlen, srv->address, \
+		             sizeof(srv->address), NULL, 0, NI_NUMERICHOST );
+
+		break;
+	} while ( ( res = res->ai_next ) );
+
+	if ( rc ) {
+		if ( srv->parent == NULL ) {
+			freeaddrinfo( srv->addr );
+			srv->addr = NULL;
+		}
+		printlog( 1, "%s connection failed", srv->host );
+		srverror( srv, ERR_CONNECT );
+		return(-1);
+	}
+
+	return(server_s);
+}
+
+
+#ifdef ENABLE_HTTPS
+static void tunnelclose( struct server *srv )
+{
+	tls_close(srv->tunnel);
+	srv->tunnel = NULL;
+}
+
+
+/* Reuse an idle connection unless anything is readable, which means it
+   was closed, or it was idle for longer than IDLE_TIMEOUT. A NAT or
+   firewall on the way may have dropped it without notice by then.
+*/
+static int reusable( struct server *srv, struct tlsconn *conn )
+{
+	struct pollfd		pfd;
+
+	if ( monotime() - srv->used > IDLE_TIMEOUT )
+		return(0);
+	pfd.fd = tls_fd(conn);
+	pfd.events = POLLIN;
+	return( poll( &pfd, 1, 0 ) == 0 );
+}
+
+
+/* Open a CONNECT tunnel through the proxy server and start TLS with the
+   web server. The tunnel is reused by the next polls, as long as neither
+   side closed it and it wasn't idle for long.
+*/
+static int tunnelconnect( struct server *srv, char *proxy, char *proxyport, int ipversion )
+{
+	char			buffer[BUFFERSIZE];
+	int			server_s, len = 0, ret, status = 0;
+	struct tlsconn		*conn;
+
+	if ( srv->tunnel ) {
+		/* The connect time to the proxy is long gone, its smoothed
+		   TCP round trip time is the current one (0 is unknown)
+		*/
+		if ( reusable( srv, srv->tunnel ) ) {
+			srv->connrtt = tcpinfortt( tls_fd(srv->tunnel) );
+			return( tls_fd(srv->tunnel) );
+		}
+		tunnelclose( srv );
+	}
+
+	server_s = sockconnect( srv, proxy, proxyport, ipversion );
+	if ( server_s < 0 )
+		return(-1);
+
+	snprintf( buffer, BUFFERSIZE, "CONNECT %s:%s HTTP/1.1\r\nHost: %s:%s\r\n" \
+	          "User-Agent: htpdate/"VERSION"\r\n\r\n", \
+	          srv->host, srv->port, srv->host, srv->port );
+	if ( send( server_s, buffer, strlen(buffer), 0 ) < 0 ) {
+		close( server_s );
+		srverror( srv, ERR_IO );
+		return(-1);
+	}
+
+	/* The proxy sends nothing after its response, until we start TLS */
+	do {
+		ret = recv( server_s, buffer + len, BUFFERSIZE - 1 - len, 0 );
+		if ( ret > 0 )
+			len += ret;
+		buffer[len] = '\0';
+	} while ( ret > 0 && len < BUFFERSIZE - 1 && strstr( buffer, "\r\n\r\n" ) == NULL );
+
+	if ( sscanf( buffer, "HTTP/%*s %d", &status ) != 1 || status != 200 ) {
+		printlog( 1, "%s proxy refused tunnel (%d)", srv->host, status );
+		close( server_s );
+		srverror( srv, ERR_CONNECT );
+		return(-1);
+	}
+
+	conn = tls_connect(server_s, srv->host, 0);
+	if (conn == NULL) {
+		printlog( 1, "%s TLS handshake failed", srv->host );
+		close( server_s );
+		srverror( srv, ERR_TLS );
+		return(-1);
+	}
+
+	srv->tunnel = conn;
+	return( server_s );
+}
+
+
+/* HEAD over the tunnel, read the response header completely to keep the
+   connection usable
+*/
+static int tunnelexchange( struct server *srv, char *buffer )
+{
+	int len = 0, ret;
+
+	if (tls_write(srv->tunnel, buffer, strlen(buffer)) <= 0) {
+		tunnelclose( srv );
+		return 0;
+	}
+	srv->sent = monotime();
+
+	do {
+		ret = tls_read(srv->tunnel, buffer + len, BUFFERSIZE - 1 - len);
+		if (ret > 0 && len == 0) {
+			srv->firstbyte = monotime();
+			srv->tcprtt = tcpinfortt( tls_fd(srv->tunnel) );
+		}
+		if (ret > 0)
+			len += ret;
+		buffer[len] = '\0';
+	} while (ret > 0 && len < BUFFERSIZE - 1 && strstr(buffer, "\r\n\r\n") == NULL);
+
+	if (ret <= 0 || strcasestr(buffer, "\nConnection: close"))
+		tunnelclose( srv );
+
+	return len > 0;
+}
+#endif
+
+
+#ifdef ENABLE_HTTPS
+/* HTTP/2 (RFC 7540), just enough for HEAD requests: one connection per web
+   server carries a new stream for every poll, a PING sent along with each
+   request measures the network round trip time without server processing.
+   Response headers are HPACK (RFC 7541) decoded, Date:, Age: and X-Cache:
+   are handed to getHTTPdate() as HTTP/1 header lines.
+*/
+#define	H2_DATA				0x0
+#define	H2_HEADERS			0x1
+#define	H2_RST_STREAM			0x3
+#define	H2_SETTINGS			0x4
+#define	H2_PING				0x6
+#define	H2_GOAWAY			0x7
+#define	H2_CONTINUATION			0x9
+#define	H2_FLAG_ACK			0x1
+#define	H2_FLAG_END_STREAM		0x1
+#define	H2_FLAG_END_HEADERS		0x4
+#define	H2_FLAG_PADDED			0x8
+#define	H2_FLAG_PRIORITY		0x20
+#define	H2_FRAME_SIZE			16384
+#define	H2_TABLE_SIZE			4096
+#define	H2_TABLE_ENTRIES		(H2_TABLE_SIZE / 32)
+
+static const char	*hpackstatic[61][2] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+	{ ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+	{ ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+	{ ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+	{ "accept-ranges", "" }, { "accept", "" },
+	{ "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+	{ "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" },
+	{ "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" },
+	{ "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" },
+	{ "expect", "" }, { "expires", "" }, { "from", "" }, { "host", "" },
+	{ "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+	{ "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" },
+	{ "proxy-authenticate", "" }, { "proxy-authorization", "" },
+	{ "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" },
+	{ "strict-transport-security", "" }, { "transfer-encoding", "" },
+	{ "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" }
+};
+
+/* Huffman code (RFC 7541 appendix B), symbol 256 is EOS */
+static const uint32_t	huffcode[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+	0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+	0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+	0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+	0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+	0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+	0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+	0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+	0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+	0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+	0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+	0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+	0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+	0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+	0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+	0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+	0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+	0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+	0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+	0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+	0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+	0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+	0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+	0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+	0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+	0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+	0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+	0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+	0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+	0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+	0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+	0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const unsigned char	hufflen[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30
+};
+
+/* Dynamic table entries keep a truncated copy, but account the full size */
+struct hpackentry {
+	char			name[32];
+	char			value[64];
+	unsigned long		size;
+};
+
+/* A request waiting for its response headers and PING ACK */
+struct h2stream {
+	unsigned		id;		/* 0 if free */
+	struct server		*srv;
+	char			*buffer;	/* response header lines */
+	double			pingsent;
+	int			headers, pinged, failed;
+};
+
+/* An HTTP/2 connection, shared by the probes of a burst. Whichever probe
+   holds the lock reads the next frame and hands it to its stream.
+*/
+struct h2conn {
+	struct tlsconn		*tls;
+	unsigned		stream;		/* last stream id */
+	struct hpackentry	table[H2_TABLE_ENTRIES];
+	int			newest, count;
+	unsigned long		size, maxsize;
+	struct h2stream		wait[BURST_PROBES];
+	unsigned char		block[2 * H2_FRAME_SIZE];	/* header block */
+	int			blocklen;
+	int			dead;		/* closed, or HPACK out of sync */
+#ifndef DISABLE_THREADS
+	pthread_mutex_t		lock;
+#endif
+};
+
+
+/* Decode an integer with an n bit prefix */
+static int hpackint( unsigned char **p, unsigned char *end, int n, unsigned long *value )
+{
+	unsigned long		mask = (1 << n) - 1;
+	int			shift = 0;
+
+	if ( *p >= end )
+		return(-1);
+	*value = *(*p)++ & mask;
+	if ( *value < mask )
+		return(0);
+
+	do {
+		if ( *p >= end || shift > 28 )
+			return(-1);
+		*value += (unsigned long)(**p & 0x7f) << shift;
+		shift += 7;
+	} while ( *(*p)++ & 0x80 );
+
+	return(0);
+}
+
+
+/* Decode a (Huffman coded) string into out, truncated to outsize.
+   Returns the decoded length.
+*/
+static long hpackstr( unsigned char **p, unsigned char *end, char *out, int outsize )
+{
+	unsigned long		len, code = 0;
+	unsigned char		*s;
+	long			n = 0;
+	int			huffman, bits = 0, i, b;
+
+	if ( *p >= end )
+		return(-1);
+	huffman = **p & 0x80;
+	if ( hpackint( p, end, 7, &len ) || len > (unsigned long)(end - *p) )
+		return(-1);
+	s = *p;
+	*p += len;
+
+	if ( !huffman ) {
+		for ( ; n < (long)len; n++ )
+			if ( n < outsize - 1 )
+				out[n] = s[n];
+	} else {
+		for ( ; s < *p; s++ ) {
+			for ( b = 7; b >= 0; b-- ) {
+				code = (code << 1) | ((*s >> b) & 1);
+				if ( ++bits < 5 )
+					continue;
+				for ( i = 0; i < 256; i++ )
+					if ( hufflen[i] == bits && huffcode[i] == code )
+						break;
+				if ( i < 256 ) {
+					if ( n < outsize - 1 )
+						out[n] = i;
+					n++;
+					code = bits = 0;
+				} else if ( bits > 30 ) {
+					return(-1);
+				}
+			}
+		}
+	}
+
+	if ( outsize > 0 )
+		out[n < outsize - 1 ? n : outsize - 1] = '\0';
+
+	return(n);
+}
+
+
+/* Evict the oldest entries until "room" more bytes fit in the table */
+static void hpackevict( struct h2conn *h2, unsigned long room )
+{
+	while ( h2->count && h2->size + room > h2->maxsize ) {
+		h2->size -= h2->table[(h2->newest - h2->count + 1 + H2_TABLE_ENTRIES) \
+		                      % H2_TABLE_ENTRIES].size;
+		h2->count--;
+	}
+}
+
+
+static void hpackadd( struct h2conn *h2, char *name, long namelen, char *value, long valuelen )
+{
+	struct hpackentry	*e;
+	unsigned long		size = namelen + valuelen + 32;
+
+	/* Evict first, the ring slot of the new entry may hold the oldest.
+	   An entry larger than the table empties it and isn't added.
+	*/
+	hpackevict( h2, size );
+	if ( size > h2->maxsize )
+		return;
+
+	h2->newest = (h2->newest + 1) % H2_TABLE_ENTRIES;
+	e = &h2->table[h2->newest];
+	snprintf( e->name, sizeof(e->name), "%s", name );
+	snprintf( e->value, sizeof(e->value), "%s", value );
+	e->size = size;
+
+	h2->count++;
+	h2->size += e->size;
+}
+
+
+/* Look up a static (1-61) or dynamic (62-) table entry */
+static int hpacklookup( struct h2conn *h2, unsigned long index, const char **name, const char **value )
+{
+	struct hpackentry	*e;
+
+	if ( index >= 1 && index <= 61 ) {
+		*name = hpackstatic[index - 1][0];
+		*value = hpackstatic[index - 1][1];
+		return(0);
+	}
+	if ( index < 62 || index - 62 >= (unsigned long)h2->count )
+		return(-1);
+
+	e = &h2->table[(h2->newest - (index - 62) + H2_TABLE_ENTRIES) % H2_TABLE_ENTRIES];
+	*name = e->name;
+	*value = e->value;
+	return(0);
+}
+
+
+/* Decode a header block, write the interesting headers as HTTP/1 lines */
+static int hpackdecode( struct h2conn *h2, unsigned char *p, unsigned char *end, char *buffer )
+{
+	char			namebuf[32], valuebuf[64];
+	const char		*name, *value;
+	unsigned long		index;
+	long			namelen, valuelen;
+	int			len = 0, prefix, indexing;
+
+	buffer[0] = '\0';
+	while ( p < end ) {
+		if ( *p & 0x80 ) {			/* indexed */
+			if ( hpackint( &p, end, 7, &index ) || \
+			     hpacklookup( h2, index, &name, &value ) )
+				return(-1);
+		} else if ( (*p & 0xe0) == 0x20 ) {	/* table size update */
+			if ( hpackint( &p, end, 5, &index ) || index > H2_TABLE_SIZE )
+				return(-1);
+			h2->maxsize = index;
+			hpackevict( h2, 0 );
+			continue;
+		} else {				/* literal */
+			indexing = (*p & 0xc0) == 0x40;
+			prefix = indexing ? 6 : 4;
+			if ( hpackint( &p, end, prefix, &index ) )
+				return(-1);
+			if ( index ) {
+				if ( hpacklookup( h2, index, &name, &value ) )
+					return(-1);
+				snprintf( namebuf, sizeof(namebuf), "%s", name );
+				namelen = strlen( name );
+			} else if ( (namelen = hpackstr( &p, end, namebuf, sizeof(namebuf) )) < 0 ) {
+				return(-1);
+			}
+			if ( (valuelen = hpackstr( &p, end, valuebuf, sizeof(valuebuf) )) < 0 )
+				return(-1);
+			if ( indexing )
+				hpackadd( h2, namebuf, namelen, valuebuf, valuelen );
+			name = namebuf;
+			value = valuebuf;
+		}
+
+		if ( strcmp( name, ":status" ) == 0 )
+			len += snprintf( buffer + len, BUFFERSIZE - len, "HTTP/2 %s\r\n", value );
+		else if ( strcmp( name, "date" ) == 0 )
+			len += snprintf( buffer + len, BUFFERSIZE - len, "Date: %s\r\n", value );
+		else if ( strcmp( name, "age" ) == 0 )
+			len += snprintf( buffer + len, BUFFERSIZE - len, "Age: %s\r\n", value );
+		else if ( strcmp( name, "x-cache" ) == 0 )
+			len += snprintf( buffer + len, BUFFERSIZE - len, "X-Cache: %s\r\n", value );
+		if ( len >= BUFFERSIZE - 1 )
+			return(-1);
+	}
+
+	snprintf( buffer + len, BUFFERSIZE - len, "\r\n" );
+	return(0);
+}
+
+
+static int h2read( struct tlsconn *tls, unsigned char *buf, int len )
+{
+	int			n, ret;
+
+	for ( n = 0; n < len; n += ret )
+		if ( (ret = tls_read( tls, buf + n, len - n )) <= 0 )
+			return(-1);
+
+	return(0);
+}
+
+
+/* Append a frame header to buf */
+static int h2frame( unsigned char *buf, int len, int type, int flags, unsigned stream )
+{
+	buf[0] = len >> 16;
+	buf[1] = len >> 8;
+	buf[2] = len;
+	buf[3] = type;
+	buf[4] = flags;
+	buf[5] = stream >> 24;
+	buf[6] = stream >> 16;
+	buf[7] = stream >> 8;
+	buf[8] = stream;
+	return(9);
+}
+
+
+static struct h2stream *h2find( struct h2conn *h2, unsigned id )
+{
+	int			i;
+
+	for ( i = 0; id && i < BURST_PROBES; i++ )
+		if ( h2->wait[i].id == id )
+			return( &h2->wait[i] );
+	return(NULL);
+}
+
+
+/* Read and handle one frame. Returns the frame type, the payload of
+   HEADERS and CONTINUATION frames is left in payload
+*/
+static int h2recv( struct h2conn *h2, unsigned char *payload, int *len, int *flags, unsigned *stream )
+{
+	struct h2stream		*w;
+	unsigned char		hdr[9], ack[9 + 8];
+	int			type;
+
+	if ( h2read( h2->tls, hdr, 9 ) )
+		return(-1);
+	*len = (hdr[0] << 16) | (hdr[1] << 8) | hdr[2];
+	type = hdr[3];
+	*flags = hdr[4];
+	*stream = ((hdr[5] & 0x7f) << 24) | (hdr[6] << 16) | (hdr[7] << 8) | hdr[8];
+	if ( *len > H2_FRAME_SIZE || h2read( h2->tls, payload, *len ) )
+		return(-1);
+
+	switch ( type ) {
+	case H2_SETTINGS:
+		if ( !(*flags & H2_FLAG_ACK) ) {
+			h2frame( ack, 0, H2_SETTINGS, H2_FLAG_ACK, 0 );
+			if ( tls_write( h2->tls, ack, 9 ) <= 0 )
+				return(-1);
+		}
+		break;
+	case H2_PING:
+		if ( *len != 8 )
+			return(-1);
+		if ( *flags & H2_FLAG_ACK ) {
+			/* Our PINGs carry the id of their stream */
+			w = h2find( h2, (payload[4] << 24) | (payload[5] << 16) | \
+			                (payload[6] << 8) | payload[7] );
+			if ( w && !w->pinged ) {
+				w->srv->pingrtt = (long)((monotime() - w->pingsent) * 1e6);
+				w->pinged = 1;
+			}
+		} else {
+			h2frame( ack, 8, H2_PING, H2_FLAG_ACK, 0 );
+			memcpy( ack + 9, payload, 8 );
+			if ( tls_write( h2->tls, ack, 9 + 8 ) <= 0 )
+				return(-1);
+		}
+		break;
+	case H2_GOAWAY:
+		return(-1);
+	}
+
+	return(type);
+}
+
+
+/* Read one frame, collect header blocks for their streams. Every block
+   is decoded, the HPACK table is shared by all streams.
+*/
+static int h2dispatch( struct h2conn *h2 )
+{
+	unsigned char		frame[H2_FRAME_SIZE], *p = frame;
+	char			scratch[BUFFERSIZE];
+	struct h2stream		*w;
+	unsigned		stream;
+	int			type, len, flags, pad = 0;
+
+	type = h2recv( h2, frame, &len, &flags, &stream );
+	if ( type < 0 )
+		return(-1);
+	w = h2find( h2, stream );
+	if ( type == H2_RST_STREAM && w )
+		w->failed = 1;
+	if ( type != H2_HEADERS && type != H2_CONTINUATION )
+		return(0);
+	if ( w && type == H2_HEADERS && h2->blocklen == 0 ) {
+		w->srv->firstbyte = monotime();
+		w->srv->tcprtt = tcpinfortt( tls_fd(h2->tls) );
+	}
+
+	if ( type == H2_HEADERS && (flags & H2_FLAG_PADDED) ) {
+		pad = *p++;
+		len--;
+	}
+	if ( type == H2_HEADERS && (flags & H2_FLAG_PRIORITY) ) {
+		p += 5;
+		len -= 5;
+	}
+	len -= pad;
+	if ( len < 0 || h2->blocklen + len > (int)sizeof(h2->block) )
+		return(-1);
+	memcpy( h2->block + h2->blocklen, p, len );
+	h2->blocklen += len;
+
+	if ( flags & H2_FLAG_END_HEADERS ) {
+		len = h2->blocklen;
+		h2->blocklen = 0;
+		if ( hpackdecode( h2, h2->block, h2->block + len, w ? w->buffer : scratch ) )
+			return(-1);
+		if ( w )
+			w->headers = 1;
+	}
+
+	return(0);
+}
+
+
+static void h2lock( struct h2conn *h2 )
+{
+#ifndef DISABLE_THREADS
+	pthread_mutex_lock( &h2->lock );
+#endif
+}
+
+static void h2unlock( struct h2conn *h2 )
+{
+#ifndef DISABLE_THREADS
+	pthread_mutex_unlock( &h2->lock );
+#endif
+}
+
+
+static void h2close( struct server *srv )
+{
+	tls_close( srv->h2->tls );
+#ifndef DISABLE_THREADS
+	pthread_mutex_destroy( &srv->h2->lock );
+#endif
+	free( srv->h2 );
+	srv->h2 = NULL;
+}
+
+
+/* Is the connection the one of the web server the burst probe belongs to */
+static int h2shared( struct server *srv )
+{
+	return( srv->parent && srv->h2 && srv->h2 == srv->parent->h2 );
+}
+
+
+/* Give up on a broken connection, a shared one is closed after the burst */
+static void h2drop( struct server *srv )
+{
+	if ( h2shared( srv ) )
+		srv->h2 = NULL;
+	else
+		h2close( srv );
+}
+
+
+/* Open (or reuse) the HTTP/2 connection. When the web server doesn't
+   negotiate h2 (ALPN), its TLS connection serves HTTP/1.1 like a tunnel.
+*/
+static int h2connect( struct server *srv, char *proxy, char *proxyport, int ipversion )
+{
+	static const char	preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+	unsigned char		buf[64];
+	struct pollfd		pfd;
+	int			server_s, len;
+	struct tlsconn		*conn;
+
+	/* Set up by the web server for all probes of a burst */
+	if ( h2shared( srv ) )
+		return( tls_fd(srv->h2->tls) );
+
+	/* HTTP/1.1 fallback connection */
+	if ( srv->tunnel ) {
+		/* The connect time to the proxy is long gone, its smoothed
+		   TCP round trip time is the current one (0 is unknown)
+		*/
+		if ( reusable( srv, srv->tunnel ) ) {
+			srv->connrtt = tcpinfortt( tls_fd(srv->tunnel) );
+			return( tls_fd(srv->tunnel) );
+		}
+		tunnelclose( srv );
+	}
+
+	if ( srv->h2 && monotime() - srv->used > IDLE_TIMEOUT )
+		h2close( srv );
+
+	/* Handle what the web server sent meanwhile, eg. PING or GOAWAY */
+	if ( srv->h2 ) {
+		pfd.fd = tls_fd(srv->h2->tls);
+		pfd.events = POLLIN;
+		while ( srv->h2 && (tls_pending(srv->h2->tls) || poll( &pfd, 1, 0 ) > 0) )
+			if ( h2dispatch( srv->h2 ) < 0 )
+				h2close( srv );
+		if ( srv->h2 && srv->h2->stream < 0x7ffffff0 )
+			return( pfd.fd );
+		if ( srv->h2 )
+			h2close( srv );
+	}
+
+	server_s = sockconnect( srv, proxy, proxyport, ipversion );
+	if ( server_s < 0 )
+		return(-1);
+
+	conn = tls_connect(server_s, srv->host, 1);
+	if (conn == NULL) {
+		printlog( 1, "%s TLS handshake failed", srv->host );
+		close( server_s );
+		srverror( srv, ERR_TLS );
+		return(-1);
+	}
+
+	if ( !tls_h2( conn ) ) {
+		if ( debug )
+			printlog( 0, "%s no HTTP/2, using HTTP/1.1", srv->host );
+		srv->tunnel = conn;
+		return( server_s );
+	}
+
+	srv->h2 = calloc( 1, sizeof(struct h2conn) );
+	if ( srv->h2 == NULL ) {
+		tls_close(conn);
+		srverror( srv, ERR_IO );
+		return(-1);
+	}
+	srv->h2->tls = conn;
+	srv->h2->maxsize = H2_TABLE_SIZE;
+	srv->h2->newest = -1;
+#ifndef DISABLE_THREADS
+	pthread_mutex_init( &srv->h2->lock, NULL );
+#endif
+
+	/* Connection preface and our (default) settings */
+	len = sizeof(preface) - 1;
+	memcpy( buf, preface, len );
+	len += h2frame( buf + len, 0, H2_SETTINGS, 0, 0 );
+	if ( tls_write(conn, buf, len) <= 0 ) {
+		h2close( srv );
+		srverror( srv, ERR_IO );
+		return(-1);
+	}
+
+	return( server_s );
+}
+
+
+/* Open a stream with a HEAD request together with a PING, wait for the
+   response headers. Probes of a burst send their requests at their own
+   instants on the shared connection, while waiting for a response each
+   probe reads frames in turn.
+*/
+static int h2exchange( struct server *srv, char *buffer )
+{
+	struct h2conn		*h2 = srv->h2;
+	unsigned char		frame[512];
+	unsigned char		*p = frame, *b;
+	struct h2stream		*w = NULL;
+	struct pollfd		pfd;
+	double			deadline;
+	unsigned		id;
+	int			i, hostlen, ok, dead;
+
+	hostlen = strlen( srv->host );
+	if ( hostlen > 127 )
+		return(0);
+
+	h2lock( h2 );
+	for ( i = 0; i < BURST_PROBES && w == NULL; i++ )
+		if ( h2->wait[i].id == 0 )
+			w = &h2->wait[i];
+	if ( h2->dead || w == NULL ) {
+		h2unlock( h2 );
+		h2drop( srv );
+		return(0);
+	}
+	id = h2->stream = h2->stream ? h2->stream + 2 : 1;
+
+	/* PING, with the stream id to match its ACK */
+	p += h2frame( p, 8, H2_PING, 0, 0 );
+	memset( p, 0, 4 );
+	p[4] = id >> 24;
+	p[5] = id >> 16;
+	p[6] = id >> 8;
+	p[7] = id;
+	p += 8;
+
+	/* HEADERS, HPACK literals without indexing and static table names */
+	b = p + 9;
+	*b++ = 0x02;				/* :method */
+	*b++ = 4;
+	memcpy( b, "HEAD", 4 );
+	b += 4;
+	*b++ = 0x87;				/* :scheme https */
+	*b++ = 0x84;				/* :path / */
+	*b++ = 0x01;				/* :authority */
+	*b++ = hostlen;
+	memcpy( b, srv->host, hostlen );
+	b += hostlen;
+	*b++ = 0x0f;				/* user-agent */
+	*b++ = 58 - 15;
+	*b++ = sizeof("htpdate/"VERSION) - 1;
+	memcpy( b, "htpdate/"VERSION, sizeof("htpdate/"VERSION) - 1 );
+	b += sizeof("htpdate/"VERSION) - 1;
+	*b++ = 0x0f;				/* cache-control */
+	*b++ = 24 - 15;
+	*b++ = 8;
+	memcpy( b, "no-cache", 8 );
+	b += 8;
+	h2frame( p, b - p - 9, H2_HEADERS, H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS, id );
+	p = b;
+
+	memset( w, 0, sizeof(*w) );
+	w->id = id;
+	w->srv = srv;
+	w->buffer = buffer;
+	srv->pingrtt = 0;
+	srv->sent = w->pingsent = monotime();
+	if ( tls_write(h2->tls, frame, p - frame) <= 0 )
+		h2->dead = 1;
+
+	/* Read frames until our headers and PING ACK are in, give another
+	   probe the lock when there is nothing to read
+	*/
+	pfd.fd = tls_fd(h2->tls);
+	pfd.events = POLLIN;
+	deadline = monotime() + IO_TIMEOUT;
+	while ( !h2->dead && !w->failed && !(w->headers && w->pinged) ) {
+		if ( tls_pending(h2->tls) || poll( &pfd, 1, 0 ) > 0 ) {
+			if ( h2dispatch( h2 ) < 0 )
+				h2->dead = 1;
+			continue;
+		}
+		if ( monotime() > deadline )
+			break;
+		h2unlock( h2 );
+		poll( &pfd, 1, 1 );
+		h2lock( h2 );
+	}
+	ok = w->headers && !w->failed;
+	w->id = 0;
+	dead = h2->dead;
+	h2unlock( h2 );
+
+	if ( dead )
+		h2drop( srv );
+	return( ok );
+}
+#endif
+
+
+static int httpconnect( struct server *srv, char *proxy, char *proxyport, int ipversion )
+{
+#ifdef ENABLE_HTTPS
+	if ( tunneled( srv, proxy ) )
+		return( tunnelconnect( srv, proxy, proxyport, ipversion ) );
+	if ( http2 && proxy == NULL && ishttps( srv ) )
+		return( h2connect( srv, proxy, proxyport, ipversion ) );
+#endif
+	return( sockconnect( srv, proxy, proxyport, ipversion ) );
+}
+
+
+/* Send the request and receive the response, over HTTP or HTTPS */
+static int httpexchange( struct server *srv, int server_s, char *buffer )
+{
+#ifdef ENABLE_HTTPS
+	if ( srv->h2 || srv->tunnel )
+		srv->used = monotime();
+	if ( srv->h2 )
+		return( h2exchange( srv, buffer ) );
+	if ( srv->tunnel )
+		return( tunnelexchange( srv, buffer ) );
+	if ( ishttps( srv ) )
+		return( getHTTPS(srv, server_s, buffer) );
+#endif
+	return( getHTTP(srv, server_s, buffer) );
+}
+
+
+/* Cached responses carry an Age: or X-Cache: HIT header, or repeat an old
+   Date: while local time moved on
+*/
+static int cached( struct server *srv, char *buffer, time_t date, time_t local )
+{
+	char			*age;
+
+	if ( (age = strcasestr( buffer, "\nAge:" )) != NULL && atol( age + 5 ) > 0 )
+		return(1);
+	if ( strcasestr( buffer, "\nX-Cache: HIT" ) != NULL )
+		return(1);
+	if ( srv->lastpoll && date == srv->lastdate && local - srv->lastpoll >= 2 )
+		return(1);
+
+	return(0);
+}
+
+
+/* Move a timestamp back by a number of micro seconds */
+static void timeback( struct timeval *timeofday, long back )
+{
+	timeofday->tv_sec -= back / 1000000;
+	timeofday->tv_usec -= back % 1000000;
+	if ( timeofday->tv_usec < 0 ) {
+		timeofday->tv_usec += 1000000;
+		timeofday->tv_sec--;
+	}
+}
+
+
+/* Via a proxy server the round trip time is made of the client to proxy
+   leg, measured by the TCP connect to the proxy, and the proxy to web server
+   leg. Proxy queuing (upstream connection setup, admission) happens before
+   the request is forwarded, so the time the web server generated its
+   response is estimated from the fastest recent proxy to web server leg.
+   Moves "timeofday" back to that moment, rejects samples which spent too
+   long in the proxy. The estimate is a model, the error bound doesn't rely
+   on it: the stamp is anywhere within the round trip, up to rtt - back
+   from that moment. Without the proxy leg (TCP Fast Open, no TCP_INFO on a
+   reused tunnel) it is the middle of the round trip.
+*/
+static int proxycorrect( struct server *srv, long rtt, struct timeval *timeofday )
+{
+	long			leg, minleg, back;
+	int			i;
+
+	if ( srv->connrtt <= 0 ) {
+		srv->bound = rtt / 2;
+		timeback( timeofday, rtt / 2 );
+		return(0);
+	}
+
+	leg = rtt - srv->connrtt;
+	if ( leg < 0 )
+		leg = 0;
+	srv->legs[srv->nlegs++ % PROXY_LEGS] = leg;
+
+	minleg = leg;
+	for ( i = 0; i < srv->nlegs && i < PROXY_LEGS; i++ )
+		if ( srv->legs[i] < minleg )
+			minleg = srv->legs[i];
+
+	if ( debug )
+		printlog( 0, "%s proxy %.3f s, web server %.3f s (min %.3f s)", \
+		          srv->host, srv->connrtt * 1e-6, leg * 1e-6, minleg * 1e-6 );
+
+	if ( leg - minleg > PROXY_MAX_DELAY ) {
+		printlog( 1, "%s proxy delay %.3f s, sample rejected", \
+		          srv->host, (leg - minleg) * 1e-6 );
+		return(-1);
+	}
+
+	back = ( srv->connrtt + minleg ) / 2;
+	timeback( timeofday, back );
+	srv->bound = rtt - back;
+
+	return(0);
+}
+
+
+/* The web server stamps its Date: somewhere between our request being
+   sent and the first byte of its response. Of that time to first byte,
+   the network round trip (HTTP/2 PING, TCP_INFO or the TCP connect) may
+   be split in any way between both directions, the rest is spent by the
+   web server. Refer the sample to the middle of this window, half of it
+   is the error bound. A TLS handshake or a slow connect no longer count.
+*/
+static void phasecorrect( struct server *srv, long rtt, struct timeval *timeofday )
+{
+	long			ttfb, net, proc;
+
+	/* No timing of the exchange, the middle of the round trip */
+	if ( srv->sent == 0 || srv->firstbyte < srv->sent ) {
+		srv->bound = rtt / 2;
+		timeback( timeofday, rtt / 2 );
+		return;
+	}
+
+	ttfb = (long)( (srv->firstbyte - srv->sent) * 1e6 );
+	if ( srv->pingrtt > 0 )
+		net = srv->pingrtt;
+	else if ( srv->tcprtt > 0 )
+		net = srv->tcprtt;
+	else
+		net = srv->connrtt;
+	if ( net > ttfb )
+		net = ttfb;
+
+	/* Average processing time of the web server */
+	proc = ttfb - net;
+	srv->proc = srv->proc ? srv->proc + ( proc - srv->proc ) / 8 : proc;
+	srv->bound = ttfb / 2;
+
+	if ( debug )
+		printlog( 0, "%s network %.3f s, server %.3f s (avg %.3f s), error %.3f s", \
+		          srv->host, net * 1e-6, proc * 1e-6, srv->proc * 1e-6, srv->bound * 1e-6 );
+
+	timeback( timeofday, (long)( (ops->monotime() - srv->firstbyte) * 1e6 ) + ttfb / 2 );
+}
+
+
+static long getHTTPdate( struct server *srv, char *proxy, char *proxyport, char *httpversion, int ipversion, int when )
+{
+	char			*host = srv->host, *port = srv->port;
+	int			server_s;
+	int			rc;
+	struct tm		tm;
+	struct timeval		timevalue = {LONG_MAX, 0};
+	struct timeval		timeofday, sent, received;
+	struct timespec		sleepspec;
+	time_t			date = 0;
+	long			rtt;
+	char			buffer[BUFFERSIZE] = { '\0' };
+	char			remote_time[25] = { '\0' };
+	char			url[URLSIZE] = { '\0' };
+	char			*pdate = NULL;
+
+	srv->polls++;
+	srv->pingrtt = srv->tcprtt = 0;
+	srv->sent = srv->firstbyte = 0;
+	srv->bound = 0;
+	srv->lasterror = NUM_ERRORS;
+
+	/* Connect to web server via proxy server or directly. HTTPS goes
+	   through a CONNECT tunnel, which is kept alive.
+	*/
+	if ( proxy != NULL && !tunneled( srv, proxy ) )
+		snprintf( url, URLSIZE, "http://%s:%s", host, port);
+
+	server_s = ops->connect( srv, proxy, proxyport, ipversion );
+	if ( server_s < 0 ) {
+		journal_poll( srv, NULL, NULL, 0, 0 );
+		return(0);				/* Assume correct time */
+	}
+
+	/* Build a combined HTTP/1.0 and 1.1 HEAD request
+	   Pragma: no-cache, "forces" an HTTP/1.0 and 1.1 compliant
+	   web server to return a fresh timestamp
+	   Connection: close, allows the server the immediately close the
+	   connection after sending the response.
+	*/
+	snprintf(buffer, BUFFERSIZE, "HEAD %s/ HTTP/1.%s\r\nHost: %s\r\nUser-Agent: htpdate/"VERSION"\r\nPragma: no-cache\r\nCache-Control: no-cache\r\nConnection: %s\r\n\r\n", url, httpversion, host, persistent( srv, proxy ) ? "keep-alive" : "close");
+
+	/* Initialize timer */
+	ops->gettime(&timeofday);
+
+	/* Initialize RTT (start of measurement) */
+	rtt = timeofday.tv_sec;
+
+	/* Wait till we reach the desired time, "when" */
+	sleepspec.tv_sec = 0;
+	if ( when >= timeofday.tv_usec ) {
+		sleepspec.tv_nsec = ( when - timeofday.tv_usec ) * 1000;
+	} else {
+		sleepspec.tv_nsec = ( 1000000 + when - timeofday.tv_usec ) * 1000;
+		rtt++;
+	}
+	ops->wait( &sleepspec );
+	sent.tv_sec = rtt;
+	sent.tv_usec = when;
+
+	rc = ops->exchange( srv, server_s, buffer );
+
+	if ( rc <= 0 ) {
+		printlog( 1, "error getting data from %s:%s", host, port );
+		srverror( srv, rc < 0 ? ERR_TLS : ERR_IO );
+	}
+
+	if ( rc > 0 ) {
+		/* Assuming that network delay (server->htpdate) is neglectable,
+		   the received web server time "should" match the local time.
+
+		   From RFC 2616 paragraph 14.18
+		   ...
+		   It SHOULD represent the best available approximation
+		   of the date and time of message generation, unless the
+		   implementation has no means of generating a reasonably
+		   accurate date and time.
+		   ...
+		*/
+
+		ops->gettime(&timeofday);
+		received = timeofday;
+
+		/* rtt contains round trip time in micro seconds, now! */
+		rtt = ( timeofday.tv_sec - rtt ) * 1000000 + \
+		      timeofday.tv_usec - when;
+
+		/* The HTTP/2 PING excludes server processing time */
+		if ( srv->pingrtt > 0 && srv->pingrtt < rtt )
+			rtt = srv->pingrtt;
+
+		/* Look for the line that contains Date: */
+		if ( ((pdate = strstr(buffer, "Date: ")) != NULL ||
+		      (pdate = strstr(buffer, "date: ")) != NULL) &&
+		     strlen( pdate ) >= 35 ) {
+			strncpy(remote_time, pdate + 11, 24);
+
+			memset(&tm, 0, sizeof(struct tm));
+			if ( strptime( remote_time, "%d %b %Y %T", &tm) == NULL) {
+				printlog( 1, "%s unknown time format", host );
+				srverror( srv, ERR_FORMAT );
+			} else if ( cached( srv, buffer, gmtmktime(&tm), timeofday.tv_sec ) ) {
+				printlog( 1, "%s cached response", host );
+				srverror( srv, ERR_CACHED );
+			} else if ( proxy != NULL && proxycorrect( srv, rtt, &timeofday ) ) {
+				srverror( srv, ERR_PROXY );
+			} else {
+				if ( proxy == NULL )
+					phasecorrect( srv, rtt, &timeofday );
+				timevalue.tv_sec = gmtmktime(&tm);
+
+				/* The Date: second was current somewhere within
+				   the error bound around timeofday
+				*/
+				srv->sample.lower = (int64_t)( timevalue.tv_sec - timeofday.tv_sec ) * 1000000000 - \
+				                    ( (int64_t)timeofday.tv_usec + srv->bound ) * 1000;
+				srv->sample.upper = srv->sample.lower + 1000000000 + (int64_t)srv->bound * 2000;
+				srv->lastdate = timevalue.tv_sec;
+				srvrtt( srv, rtt );
+				srv->lastpoll = timeofday.tv_sec;
+				logsample( host, port, rtt, ( srv->sample.lower + \
+				           srv->sample.upper ) * 0.5e-9, NUM_ERRORS );
+			}
+
+			if ( srv->lasterror != ERR_FORMAT )
+				date = gmtmktime(&tm);
+
+			/* Print host, raw timestamp, round trip time */
+			if ( debug )
+				printlog( 0, "%-25s %s %s (%.3f) => %li", host, port, remote_time, \
+				          rtt * 1e-6, timevalue.tv_sec - timeofday.tv_sec );
+
+		} else {
+			printlog( 1, "%s no timestamp", host );
+			srverror( srv, ERR_NODATE );
+		}
+
+	}						/* bytes received */
+
+	journal_poll( srv, &sent, rc > 0 ? &received : NULL, date, rc > 0 ? rtt : 0 );
+
+	/* Return the time delta between web server time (timevalue)
+	   and system time (timeofday)
+	*/
+	return( timevalue.tv_sec - timeofday.tv_sec );
+
+}
+
+
+static int setclock( double timedelta, int setmode )
+{
+	struct timeval		timeofday;
+
+	if ( timedelta == 0 ) {
+		printlog( 0, "No time correction needed" );
+		return(0);
+	}
+
+	switch ( setmode ) {
+
+	case 0:						/* No time adjustment, just print time */
+		printlog( 0, "Offset %.3f seconds", timedelta );
+		return(0);
+
+	case 1:						/* Adjust time smoothly */
+		timeofday.tv_sec  = (long)timedelta;
+		timeofday.tv_usec = (long)((timedelta - timeofday.tv_sec) * 1000000);
+
+		printlog( 0, "Adjusting %.3f seconds", timedelta );
+
+		return( ops->adjtime(&timeofday) );
+
+	case 2:					/* Set time */
+		printlog( 0, "Setting %.3f seconds", timedelta );
+
+		ops->gettime( &timeofday );
+		timedelta += ( timeofday.tv_sec + timeofday.tv_usec*1e-6 );
+
+		timeofday.tv_sec  = (long)timedelta;
+		timeofday.tv_usec = (long)((timedelta - timeofday.tv_sec) * 1000000);
+
+		printlog( 0, "Set: %s", asctime(localtime(&timeofday.tv_sec)) );
+
+		return( ops->settime(&timeofday) );
+
+	case 3:					/* Set frequency, but first an adjust */
+		return( setclock( timedelta, 1 ) );
+
+
+	default:
+		return(-1);
+
+	}
+
+}
+
+
+static int htpdate_adjtimex( double drift )
+{
+	struct timex		tmx;
+	long			freq;
+
+	/* Read current kernel frequency */
+	tmx.modes = 0;
+	ops->adjtimex(&tmx);
+
+	/* Calculate new frequency */
+	freq = (long)(65536e6 * drift);
+
+	/* Take the average of current and new drift values */
+	tmx.freq = tmx.freq + (freq >> 1);
+	if ( (tmx.freq < -MAX_DRIFT) || (tmx.freq > MAX_DRIFT) )
+		tmx.freq = sign(tmx.freq) * MAX_DRIFT;
+
+	printlog( 0, "Adjusting frequency %li", tmx.freq );
+	tmx.modes = MOD_FREQUENCY;
+
+	return( ops->adjtimex(&tmx) );
+
+}
+
+
+/* Poll interval controller state */
+static struct {
+	double			last;		/* expected offset (s) */
+	double			jitter;		/* average offset surprise (s) */
+	double			drift;		/* last drift estimate */
+	double			driftjitter;	/* its average change */
+	int			drifts;		/* number of drift estimates */
+	int			count;		/* hysteresis counter */
+	int			cycles;
+} pollctl;
+
+
+/* Keep track of the drift estimates, how much they agree is the
+   confidence in the drift
+*/
+static void pollctl_drift( double drift )
+{
+	if ( pollctl.drifts++ )
+		pollctl.driftjitter += ( fabs( drift - pollctl.drift ) - pollctl.driftjitter ) / 4;
+	pollctl.drift = drift;
+}
+
+
+/* Pick the next poll interval, in the spirit of the NTP poll adaptation.
+   After POLL_LIMIT cycles in a row with an offset and jitter well within
+   the accuracy target the interval doubles, an offset beyond the target
+   halves it. An offset which differs a lot from what was expected
+   suggests a step of the clock (or of the web servers), polling restarts
+   at the minimum interval. Finally the interval is kept short enough for
+   the worst case drift not to exceed half the target.
+*/
+static int pollctl_update( int sleeptime, int minsleep, int maxsleep, \
+                           double offset, double target, int corrected )
+{
+	double			surprise, drift, limit;
+
+	surprise = fabs( offset - pollctl.last );
+	if ( pollctl.cycles++ == 0 ) {
+		pollctl.jitter = 0;
+	} else if ( surprise > target && surprise > 4 * pollctl.jitter ) {
+		printlog( 0, "Offset %.3f s unexpected, step suspected", offset );
+		pollctl.count = 0;
+		sleeptime = minsleep;
+	} else {
+		pollctl.jitter += ( surprise - pollctl.jitter ) / 4;
+		if ( fabs( offset ) <= target / 2 && pollctl.jitter <= target / 2 ) {
+			if ( ++pollctl.count >= POLL_LIMIT ) {
+				pollctl.count = 0;
+				sleeptime <<= 1;
+			}
+		} else if ( fabs( offset ) > target ) {
+			pollctl.count = 0;
+			sleeptime >>= 1;
+		}
+	}
+
+	/* A corrected offset is gone by the next poll */
+	pollctl.last = corrected ? 0 : offset;
+
+	/* The fewer drift estimates agree, the larger the drift to assume */
+	if ( pollctl.drifts > 1 ) {
+		drift = fabs( pollctl.drift ) + pollctl.driftjitter;
+		if ( drift > 0 ) {
+			limit = target / ( 2 * drift );
+			if ( sleeptime > limit )
+				sleeptime = (int)limit;
+		}
+	}
+
+	if ( sleeptime < minsleep )
+		sleeptime = minsleep;
+	if ( sleeptime > maxsleep )
+		sleeptime = maxsleep;
+
+	return( sleeptime );
+}
+
+
+/* Count a failed poll. After BREAKER_FAILURES in a row the web server
+   is skipped for an exponentially growing time, then a single poll
+   probes it again.
+*/
+static void srvbackoff( struct server *srv, time_t now )
+{
+	long			backoff;
+	int			n;
+
+	if ( ++srv->consecutive < BREAKER_FAILURES )
+		return;
+
+	n = srv->consecutive - BREAKER_FAILURES;
+	backoff = n < 16 ? (long)BACKOFF_MIN << n : DEFAULT_MAX_SLEEP;
+	if ( backoff > DEFAULT_MAX_SLEEP )
+		backoff = DEFAULT_MAX_SLEEP;
+	srv->retry = now + backoff;
+
+	printlog( 1, "%s:%s failed %d times, next try in %ld s", \
+	          srv->host, srv->port, srv->consecutive, backoff );
+}
+
+
+/* Is an offset interval within the time limit (-t) */
+static int withinlimit( struct interval *sample )
+{
+	int64_t			limit = (int64_t)cycle.timelimit * 1000000000;
+
+	return( cycle.timelimit == NO_TIME_LIMIT || \
+	        ( sample->upper < limit && sample->lower > -limit ) );
+}
+
+
+/* Hand an offset interval to the combiner, if within the time limit */
+static void pollsample( struct server *srv )
+{
+	struct interval		*sample = &srv->sample;
+	struct journalrec	rec;
+	int			i;
+
+	if ( withinlimit( sample ) ) {
+		i = __sync_fetch_and_add( &cycle.validtimes, 1 );
+		cycle.samples[i] = *sample;
+
+		memset( &rec, 0, sizeof(rec) );
+		rec.type = JOURNAL_SAMPLE;
+		rec.result = NUM_ERRORS;
+		rec.rtt = srv->rtt;
+		rec.bound = srv->bound;
+		rec.lower = sample->lower;
+		rec.upper = sample->upper;
+		journal_write( &rec, srv );
+	}
+
+	/* If we detected a time offset, set the flag */
+	if ( sample->lower > 0 || sample->upper < 0 )
+		cycle.offsetdetect = 1;
+}
+
+
+/* A burst probe, a copy of the web server with its own connection */
+struct probe {
+	struct server		srv;
+	int			when;
+	int			started;
+#ifndef DISABLE_THREADS
+	pthread_t		thread;
+#endif
+};
+
+static void *probethread( void *arg )
+{
+	struct probe		*p = arg;
+
+	getHTTPdate( &p->srv, cycle.proxy, cycle.proxyport, \
+	             cycle.httpversion, cycle.ipversion, p->when );
+	return(NULL);
+}
+
+
+/* Burst mode: BURST_PROBES probes of a web server at once, each sent at
+   its own instant within a second. Over HTTP/2 they are streams on one
+   connection, otherwise each has its own connection and one tunnel is
+   kept for the first probe of the next burst. A valid probe bounds the
+   offset to an interval, from its Date: second and its error bound. The
+   intervals are intersected starting with the fastest probe, probes that
+   contradict the faster ones (delayed by congestion) are left out. The
+   middle of the intersection is the one sample of the web server for the
+   combiner.
+*/
+static double burstserver( struct server *srv, int when, time_t now )
+{
+	struct probe		probe[BURST_PROBES], *p, *order[BURST_PROBES];
+	double			polltime;
+	struct interval		is = { INT64_MIN, INT64_MAX };
+	int			i, j, n = 0, used = 0, failed = 0, refused = 0;
+	int			err = NUM_ERRORS, nlegs = srv->nlegs;
+#ifdef ENABLE_HTTPS
+	int			shared = 0;
+#endif
+
+#ifndef SIMULATOR
+	/* One name lookup for all probes */
+	if ( srvresolve( srv, cycle.proxy, cycle.proxyport, cycle.ipversion ) ) {
+		srvbackoff( srv, now );
+		return(0);
+	}
+
+#ifdef ENABLE_HTTPS
+	/* Over HTTP/2 the probes are streams on one connection */
+	if ( http2 && cycle.proxy == NULL && ishttps( srv ) ) {
+		if ( h2connect( srv, NULL, NULL, cycle.ipversion ) < 0 ) {
+			srvbackoff( srv, now );
+			return(0);
+		}
+		shared = srv->h2 != NULL;
+	}
+#endif
+#endif
+
+	polltime = -monotime();
+	for ( i = 0; i < BURST_PROBES; i++ ) {
+		p = &probe[i];
+		p->srv = *srv;
+		p->srv.parent = srv;
+		p->srv.polls = p->srv.failures = 0;
+		p->srv.rttsum = 0;
+		memset( p->srv.errors, 0, sizeof(p->srv.errors) );
+		memset( p->srv.rtthist, 0, sizeof(p->srv.rtthist) );
+#ifdef ENABLE_HTTPS
+		/* Otherwise the first probe takes over the open connection */
+		if ( !shared ) {
+			srv->tunnel = NULL;
+			srv->h2 = NULL;
+		}
+#endif
+		p->when = ( when + (2 * i + 1) * (500000 / BURST_PROBES) ) % 1000000;
+
+		/* The simulator has one virtual clock, probe one by one */
+#if defined SIMULATOR || defined DISABLE_THREADS
+		p->started = 0;
+		probethread( p );
+#else
+		p->started = pthread_create( &p->thread, NULL, probethread, p ) == 0;
+		if ( !p->started )
+			probethread( p );
+#endif
+	}
+
+	for ( i = 0; i < BURST_PROBES; i++ ) {
+		p = &probe[i];
+#ifndef DISABLE_THREADS
+		if ( p->started )
+			pthread_join( p->thread, NULL );
+#endif
+
+		/* Add the counters of the probe to the web server */
+		srv->polls += p->srv.polls;
+		srv->failures += p->srv.failures;
+		srv->rttsum += p->srv.rttsum;
+		for ( j = 0; j < NUM_ERRORS; j++ )
+			srv->errors[j] += p->srv.errors[j];
+		for ( j = 0; j < RTT_BUCKETS; j++ )
+			srv->rtthist[j] += p->srv.rtthist[j];
+
+		/* And the proxy to web server leg it measured, if any */
+		if ( p->srv.nlegs > nlegs )
+			srv->legs[srv->nlegs++ % PROXY_LEGS] = \
+				p->srv.legs[(p->srv.nlegs - 1) % PROXY_LEGS];
+#ifdef ENABLE_HTTPS
+		/* Keep one connection open for the next burst */
+		if ( shared )
+			;
+		else if ( srv->tunnel == NULL && srv->h2 == NULL ) {
+			srv->tunnel = p->srv.tunnel;
+			srv->h2 = p->srv.h2;
+			srv->used = p->srv.used;
+		} else {
+			if ( p->srv.tunnel )
+				tunnelclose( &p->srv );
+			if ( p->srv.h2 )
+				h2close( &p->srv );
+		}
+#endif
+		if ( p->srv.lasterror < ERR_PROXY )
+			failed++;
+		if ( p->srv.lasterror == ERR_CONNECT )
+			refused++;
+		if ( p->srv.lasterror < err )
+			err = p->srv.lasterror;
+		if ( p->srv.lasterror != NUM_ERRORS )
+			continue;
+
+		/* Valid probes, fastest first */
+		for ( j = n++; j > 0 && order[j-1]->srv.bound > p->srv.bound; j-- )
+			order[j] = order[j-1];
+		order[j] = p;
+	}
+	polltime += monotime();
+
+#ifdef ENABLE_HTTPS
+	if ( shared && srv->h2->dead )
+		h2close( srv );
+	else if ( shared )
+		srv->used = monotime();
+#endif
+
+	if ( refused && srv->addr ) {
+		freeaddrinfo( srv->addr );
+		srv->addr = NULL;
+	}
+
+	/* The web server failed only if all probes did */
+	if ( n == 0 ) {
+		srv->lasterror = err;
+		if ( failed )
+			srvbackoff( srv, now );
+		return( polltime );
+	}
+	srv->lasterror = NUM_ERRORS;
+
+	for ( i = 0; i < n; i++ ) {
+		p = order[i];
+		if ( p->srv.sample.lower > is.upper || p->srv.sample.upper < is.lower )
+			continue;
+		if ( p->srv.sample.lower > is.lower )
+			is.lower = p->srv.sample.lower;
+		if ( p->srv.sample.upper < is.upper )
+			is.upper = p->srv.sample.upper;
+		used++;
+	}
+
+	/* The fastest probe tells about the web server */
+	p = order[0];
+	srv->rtt = p->srv.rtt;
+	srv->connrtt = p->srv.connrtt;
+	srv->proc = p->srv.proc;
+	srv->lastdate = p->srv.lastdate;
+	srv->lastpoll = p->srv.lastpoll;
+	srv->consecutive = 0;
+	strcpy( srv->address, p->srv.address );
+
+	srv->sample = is;
+	srv->bound = (long)( ( is.upper - is.lower ) / 2000 );
+
+	if ( debug )
+		printlog( 0, "%-25s %s burst %d/%d probes, offset %.3f s, error %.3f s", \
+		          srv->host, srv->port, used, n, ( is.lower + is.upper ) * 0.5e-9, \
+		          srv->bound * 1e-6 );
+
+	pollsample( srv );
+
+	return( polltime );
+}
+
+
+/* Poll a web server, in burst mode multiple times, and collect the time
+   deltas of the valid responses. Returns the time spent polling.
+*/
+static double pollserver( struct server *srv, int when )
+{
+	int			try, timestamp, halfopen;
+	double			polltime = 0;
+	struct timeval		timeofday;
+
+	/* Circuit breaker, open: skip the web server, half open: probe once */
+	ops->gettime( &timeofday );
+	halfopen = srv->consecutive >= BREAKER_FAILURES;
+	if ( halfopen && timeofday.tv_sec < srv->retry ) {
+		if ( debug )
+			printlog( 0, "%s:%s skipped for %ld s", srv->host, srv->port, \
+			          (long)(srv->retry - timeofday.tv_sec) );
+		return( polltime );
+	}
+
+	srv->polled = cycle.id;
+	if ( cycle.burstmode && !halfopen )
+		return( burstserver( srv, when, timeofday.tv_sec ) );
+
+	/* Retry if first poll shows time offset */
+	try = MAX_ATTEMPT;
+	do {
+		if ( debug ) printlog( 0, "try: %d when: %d", MAX_ATTEMPT - try + 1, when );
+		polltime -= monotime();
+		timestamp = getHTTPdate( srv, cycle.proxy, cycle.proxyport,\
+		                         cycle.httpversion, cycle.ipversion, when );
+		polltime += monotime();
+		try--;
+	} while ( timestamp && try && srv->lasterror == NUM_ERRORS );
+
+	/* Rejected samples (cached, proxy delay) don't count as failure */
+	if ( srv->lasterror < ERR_PROXY ) {
+		srvbackoff( srv, timeofday.tv_sec );
+		return( polltime );
+	}
+	if ( srv->lasterror == NUM_ERRORS )
+		srv->consecutive = 0;
+
+	/* Only include valid responses */
+	if ( srv->lasterror == NUM_ERRORS )
+		pollsample( srv );
+
+	return( polltime );
+}
+
+
+/* In case we have more than one web server defined, we
+   spread the polls equal within a second and take a "nap" in between
+*/
+static int napspread( int numservers, int precision )
+{
+	if ( numservers > 1 )
+		if ( precision && (numservers > 2) )
+			return( (1000000 - 2*precision) / (numservers - 1) );
+		else
+			return( 1000000 / (numservers + 1) );
+	else
+		return( 500000 );
+}
+
+
+/* The "when" of the poll of a web server. Polls are spread equally within
+   a second over all web servers.
+   Example:
+   2 servers => 0.333, 0.666
+   3 servers => 0.250, 0.500, 0.750
+   4 servers => 0.200, 0.400, 0.600, 0.800
+   ...
+   nap = 1000000 / (#servers + 1)
+
+   or when "precision" is specified, a different algorithm is used.
+   Burst mode spreads the probes of each web server over a second.
+*/
+static int pollwhen( int when, int i )
+{
+	return( cycle.burstmode ? when : when + i * cycle.nap );
+}
+
+
+#ifndef DISABLE_THREADS
+static void *worker( void *arg )
+{
+	int			id = (int)(intptr_t)arg;
+	int			i;
+
+	for (;;) {
+		while ( sem_wait( &workers.go[id] ) && errno == EINTR );
+
+		for ( i = 0; i < cycle.numservers; i++ )
+			if ( workers.servers[i].worker == id )
+				pollserver( &workers.servers[i], pollwhen( workers.when, i ) );
+
+		sem_post( &workers.done );
+	}
+
+	return(NULL);
+}
+
+
+#endif
+
+
+/* Shard a web server by hash of host, port and path */
+static void workers_shard( struct server *srv, int n )
+{
+	unsigned		hash = 5381;
+	char			*c;
+
+	for ( c = srv->host; *c; c++ )
+		hash = hash * 33 + (unsigned char)*c;
+	for ( c = srv->port; *c; c++ )
+		hash = hash * 33 + (unsigned char)*c;
+	for ( c = srv->path; *c; c++ )
+		hash = hash * 33 + (unsigned char)*c;
+	srv->worker = hash % n;
+}
+
+
+#ifndef DISABLE_THREADS
+/* Start the worker threads and shard the web servers */
+static int workers_start( int n, struct server *servers, int numservers )
+{
+	int			i;
+
+	workers.servers = servers;
+	for ( i = 0; i < numservers; i++ )
+		workers_shard( &servers[i], n );
+
+	if ( sem_init( &workers.done, 0, 0 ) )
+		return(-1);
+	for ( i = 0; i < n; i++ ) {
+		if ( sem_init( &workers.go[i], 0, 0 ) || \
+		     pthread_create( &workers.thread[i], NULL, worker, (void *)(intptr_t)i ) ) {
+			printlog( 1, "Error starting worker threads" );
+			return(-1);
+		}
+		workers.n++;
+	}
+
+	return(0);
+}
+
+
+static void watchdog( void );
+
+/* Run a poll cycle on the worker threads and wait until all are done,
+   keep the watchdog alive meanwhile
+*/
+static double workers_poll( int when )
+{
+	struct timespec		ts;
+	double			polltime;
+	int			i;
+
+	polltime = monotime();
+	workers.when = when;
+	__sync_synchronize();
+
+	for ( i = 0; i < workers.n; i++ )
+		sem_post( &workers.go[i] );
+	for ( i = 0; i < workers.n; ) {
+		clock_gettime( CLOCK_REALTIME, &ts );
+		ts.tv_sec++;
+		if ( sem_timedwait( &workers.done, &ts ) == 0 )
+			i++;
+		watchdog();
+	}
+
+	return( monotime() - polltime );
+}
+#endif
+
+
+#ifndef DISABLE_NTPSHM
+/* Attach to the NTP shared memory segment of the given unit. Units 0 and 1
+   are private to root, units 2 and up are world writable (like ntpd does).
+*/
+static int ntpshm_attach( int unit )
+{
+	int			shmid;
+	void			*p;
+
+	shmid = shmget( NTPD_SHM_BASE + unit, sizeof(struct shmTime), \
+	                IPC_CREAT | (unit < 2 ? 0600 : 0666) );
+	if ( shmid < 0 ) {
+		printlog( 1, "shmget() unit %d", unit );
+		return(-1);
+	}
+
+	p = shmat( shmid, NULL, 0 );
+	if ( p == (void *)-1 ) {
+		printlog( 1, "shmat() unit %d", unit );
+		return(-1);
+	}
+
+	ntpshm = (struct shmTime *)p;
+	ntpshm->mode = 1;
+	ntpshm->valid = 0;
+
+	return(0);
+}
+
+
+/* Publish a time offset in the NTP shared memory segment, instead of
+   correcting the clock ourselves. The reader (ntpd or chrony) checks that
+   "count" didn't change while it copied the sample, so bump it before and
+   after the update and flip "valid" last.
+*/
+static int ntpshm_update( double timedelta, double timeerr )
 {
 	struct timeval		timeofday;
+	double			reftime;
+	int			prec;
+
+	if ( ntpshm == NULL )
+		return(-1);
+
+	ops->gettime( &timeofday );
+	reftime = timeofday.tv_sec + timeofday.tv_usec * 1e-6 + timedelta;
+
+	/* The precision is the combined error bound, rounded up to a power
+	   of two (log2 s), so ntpd or chrony weigh the sample by it
+	*/
+	for ( prec = -20; ldexp( 1, prec ) < timeerr && prec < 8; prec++ );
+
+	ntpshm->valid = 0;
+	ntpshm->count++;
+	__sync_synchronize();
+
+	ntpshm->clockTimeStampSec = (time_t)reftime;
+	ntpshm->clockTimeStampUSec = (int)((reftime - (time_t)reftime) * 1e6);
+	ntpshm->clockTimeStampNSec = (unsigned)((reftime - (time_t)reftime) * 1e9);
+	ntpshm->receiveTimeStampSec = timeofday.tv_sec;
+	ntpshm->receiveTimeStampUSec = timeofday.tv_usec;
+	ntpshm->receiveTimeStampNSec = timeofday.tv_usec * 1000;
+	ntpshm->leap = 0;			/* LEAP_NOWARNING */
+	ntpshm->precision = prec;
+	ntpshm->nsamples = 0;
+
+	__sync_synchronize();
+	ntpshm->count++;
+	ntpshm->valid = 1;
+
+	printlog( 0, "Offset %.3f seconds exported to NTP SHM", timedelta );
+
+	return(0);
+}
+#endif
+
+
+/* Create the status page, readable for everyone */
+static int status_open( char *statusfile )
+{
+	int			fd;
+	void			*p;
+
+	fd = open( statusfile, O_RDWR | O_CREAT, 0644 );
+	if ( fd < 0 ) {
+		printlog( 1, "Error opening status file %s", statusfile );
+		return(-1);
+	}
+
+	if ( ftruncate( fd, sizeof(struct htpstatus) ) < 0 ) {
+		printlog( 1, "Error truncating status file %s", statusfile );
+		close( fd );
+		return(-1);
+	}
+
+	p = mmap( NULL, sizeof(struct htpstatus), PROT_READ | PROT_WRITE, \
+	          MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( p == MAP_FAILED ) {
+		printlog( 1, "mmap() status file %s", statusfile );
+		return(-1);
+	}
+
+	status = (struct htpstatus *)p;
+	memset( status, 0, sizeof(struct htpstatus) );
+	status->magic = STATUS_MAGIC;
+	status->version = STATUS_VERSION;
+
+	return(0);
+}
+
+
+/* Publish the state of a poll cycle on the status page (seqlock writer) */
+static void status_update( struct server *servers, int numservers, \
+                           double offset, double error, double drift, int synced )
+{
+	struct htpstatus_server	*s;
+	int			i;
+
+	if ( status == NULL )
+		return;
+
+	status->seq++;
+	__sync_synchronize();
+
+	status->numservers = numservers;
+	status->drift = drift * 1e6;
+	status->lastupdate = time(NULL);
+	if ( synced ) {
+		status->offset = offset;
+		status->error = error;
+		status->lastsync = status->lastupdate;
+	}
+
+	for ( i = 0; i < numservers; i++ ) {
+		s = &status->server[i];
+		snprintf( s->host, sizeof(s->host), "%s", servers[i].host );
+		snprintf( s->port, sizeof(s->port), "%s", servers[i].port );
+		s->offset = ( servers[i].sample.lower + servers[i].sample.upper ) * 0.5e-9;
+		s->error = ( servers[i].sample.upper - servers[i].sample.lower ) * 0.5e-9;
+		s->rtt = servers[i].rtt * 1e-6;
+		s->lastpoll = servers[i].lastpoll;
+		s->polls = servers[i].polls;
+		s->failures = servers[i].failures;
+	}
+
+	__sync_synchronize();
+	status->seq++;
+}
+
+
+#ifndef DISABLE_METRICS
+/* Open the metrics listener on a Unix socket (path) or [address:]port,
+   by default on localhost
+*/
+static int metrics_open( char *addr )
+{
+	struct addrinfo		hints, *res;
+	struct sockaddr_un	sun;
+	char			*host, *port = NULL;
+	int			fd, rc, on = 1;
+
+	if ( addr[0] == '/' ) {
+		memset( &sun, 0, sizeof(sun) );
+		sun.sun_family = AF_UNIX;
+		snprintf( sun.sun_path, sizeof(sun.sun_path), "%s", addr );
+		unlink( addr );
+
+		fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+		rc = fd < 0 || bind( fd, (struct sockaddr *)&sun, sizeof(sun) );
+	} else {
+		host = strdup( addr );
+		splithostport( &host, &port );
+		if ( port == NULL ) {
+			port = host;
+			host = "127.0.0.1";
+		}
+
+		memset( &hints, 0, sizeof(hints) );
+		hints.ai_family = PF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		if ( getaddrinfo( host, port, &hints, &res ) ) {
+			printlog( 1, "%s metrics address unavailable", addr );
+			return(-1);
+		}
+
+		fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
+		if ( fd >= 0 )
+			setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+		rc = fd < 0 || bind( fd, res->ai_addr, res->ai_addrlen );
+		freeaddrinfo( res );
+	}
+
+	if ( rc || listen( fd, 8 ) ) {
+		printlog( 1, "Error opening metrics listener %s", addr );
+		if ( fd >= 0 )
+			close( fd );
+		return(-1);
+	}
+	fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+	metrics.fd = fd;
+
+	return(0);
+}
+
+
+/* Append to the metrics page */
+static void mprintf( char *format, ... ) __attribute__ ((format (printf, 1, 2)));
+static void mprintf( char *format, ... )
+{
+	va_list			args;
+	int			len;
+
+	va_start(args, format);
+	len = vsnprintf( metrics.buf + metrics.len, \
+	                 sizeof(metrics.buf) - metrics.len, format, args );
+	va_end(args);
+
+	if ( len > 0 && metrics.len + len < (int)sizeof(metrics.buf) )
+		metrics.len += len;
+}
+
+
+static void mheader( char *name, char *type, char *help )
+{
+	mprintf( "# HELP htpdate_%s %s\n# TYPE htpdate_%s %s\n", \
+	         name, help, name, type );
+}
+
+
+/* Format the metrics page in the Prometheus text format, from the
+   preaggregated counters
+*/
+static void metrics_format( void )
+{
+	struct server		*srv;
+	struct timex		tmx;
+	unsigned long		count;
+	double			scale;
+	int			i, j, state;
+
+	metrics.len = 0;
+
+	mheader( "offset_seconds", "gauge", "Combined time offset of the last poll cycle." );
+	mprintf( "htpdate_offset_seconds %.6f\n", metrics.offset );
+	mheader( "offset_error_seconds", "gauge", "Error bound of the combined time offset." );
+	mprintf( "htpdate_offset_error_seconds %.6f\n", metrics.error );
+	mheader( "drift_ppm", "gauge", "Estimated systematic clock drift." );
+	mprintf( "htpdate_drift_ppm %.3f\n", metrics.drift * 1e6 );
+	mheader( "poll_cycles_total", "counter", "Number of poll cycles." );
+	mprintf( "htpdate_poll_cycles_total %lu\n", metrics.cycles );
+	mheader( "poll_cycle_duration_seconds", "gauge", "Time spent polling in the last poll cycle." );
+	mprintf( "htpdate_poll_cycle_duration_seconds %.6f\n", metrics.cycletime );
+	mheader( "adjustments_total", "counter", "Number of time corrections." );
+	mprintf( "htpdate_adjustments_total %lu\n", metrics.adjustments );
+	mheader( "adjustment_seconds_total", "counter", "Sum of the magnitudes of the time corrections." );
+	mprintf( "htpdate_adjustment_seconds_total %.6f\n", metrics.adjustsum );
+	mheader( "last_adjustment_seconds", "gauge", "Last time correction." );
+	mprintf( "htpdate_last_adjustment_seconds %.6f\n", metrics.lastadjust );
+	mheader( "frequency_adjustments_total", "counter", "Number of kernel frequency corrections." );
+	mprintf( "htpdate_frequency_adjustments_total %lu\n", metrics.freqadjustments );
+
+	mheader( "server_offset_seconds", "gauge", "Middle of the last sample per web server." );
+	for ( i = 0; i < metrics.numservers; i++ ) {
+		srv = &metrics.servers[i];
+		mprintf( "htpdate_server_offset_seconds{host=\"%s\",port=\"%s\",path=\"%s\"} %.6f\n", \
+		         srv->host, srv->port, srv->path, \
+		         ( srv->sample.lower + srv->sample.upper ) * 0.5e-9 );
+	}
+	mheader( "server_polls_total", "counter", "Polls per web server." );
+	for ( i = 0; i < metrics.numservers; i++ ) {
+		srv = &metrics.servers[i];
+		mprintf( "htpdate_server_polls_total{host=\"%s\",port=\"%s\",path=\"%s\"} %lu\n", \
+		         srv->host, srv->port, srv->path, srv->polls );
+	}
+	mheader( "server_failures_total", "counter", "Failed polls per web server and error class." );
+	for ( i = 0; i < metrics.numservers; i++ ) {
+		srv = &metrics.servers[i];
+		for ( j = 0; j < NUM_ERRORS; j++ )
+			mprintf( "htpdate_server_failures_total{host=\"%s\",port=\"%s\",path=\"%s\",class=\"%s\"} %lu\n", \
+			         srv->host, srv->port, srv->path, errorname[j], srv->errors[j] );
+	}
+	mheader( "server_consecutive_failures", "gauge", "Failed polls in a row per web server, skipped from 3." );
+	for ( i = 0; i < metrics.numservers; i++ ) {
+		srv = &metrics.servers[i];
+		mprintf( "htpdate_server_consecutive_failures{host=\"%s\",port=\"%s\",path=\"%s\"} %d\n", \
+		         srv->host, srv->port, srv->path, srv->consecutive );
+	}
+	mheader( "server_processing_seconds", "gauge", "Average processing time per web server." );
+	for ( i = 0; i < metrics.numservers; i++ ) {
+		srv = &metrics.servers[i];
+		mprintf( "htpdate_server_processing_seconds{host=\"%s\",port=\"%s\",path=\"%s\"} %.6f\n", \
+		         srv->host, srv->port, srv->path, srv->proc * 1e-6 );
+	}
+	mheader( "server_error_seconds", "gauge", "Error bound of the last sample per web server." );
+	for ( i = 0; i < metrics.numservers; i++ ) {
+		srv = &metrics.servers[i];
+		mprintf( "htpdate_server_error_seconds{host=\"%s\",port=\"%s\",path=\"%s\"} %.6f\n", \
+		         srv->host, srv->port, srv->path, srv->bound * 1e-6 );
+	}
+	mheader( "server_rtt_seconds", "histogram", "Round trip time per web server." );
+	for ( i = 0; i < metrics.numservers; i++ ) {
+		srv = &metrics.servers[i];
+		count = 0;
+		for ( j = 0; j < RTT_BUCKETS; j++ ) {
+			count += srv->rtthist[j];
+			if ( j < RTT_BUCKETS - 1 )
+				mprintf( "htpdate_server_rtt_seconds_bucket{host=\"%s\",port=\"%s\",path=\"%s\",le=\"%g\"} %lu\n", \
+				         srv->host, srv->port, srv->path, rttbucket[j] * 1e-6, count );
+			else
+				mprintf( "htpdate_server_rtt_seconds_bucket{host=\"%s\",port=\"%s\",path=\"%s\",le=\"+Inf\"} %lu\n", \
+				         srv->host, srv->port, srv->path, count );
+		}
+		mprintf( "htpdate_server_rtt_seconds_sum{host=\"%s\",port=\"%s\",path=\"%s\"} %.6f\n", \
+		         srv->host, srv->port, srv->path, srv->rttsum );
+		mprintf( "htpdate_server_rtt_seconds_count{host=\"%s\",port=\"%s\",path=\"%s\"} %lu\n", \
+		         srv->host, srv->port, srv->path, count );
+	}
 
-	if ( timedelta == 0 ) {
-		printlog( 0, "No time correction needed" );
-		return(0);
+	if ( metrics.proxy ) {
+		srv = metrics.proxy;
+		mheader( "proxy_rtt_seconds", "gauge", "Round trip time of the proxy server itself." );
+		mprintf( "htpdate_proxy_rtt_seconds %.6f\n", srv->rtt * 1e-6 );
+		mheader( "proxy_connect_seconds", "gauge", "TCP connect time to the proxy server." );
+		mprintf( "htpdate_proxy_connect_seconds %.6f\n", srv->connrtt * 1e-6 );
+		mheader( "proxy_offset_seconds", "gauge", "Time delta of the proxy server clock." );
+		mprintf( "htpdate_proxy_offset_seconds %.6f\n", \
+		         ( srv->sample.lower + srv->sample.upper ) * 0.5e-9 );
 	}
 
-	switch ( setmode ) {
+	/* Kernel clock state, reading it is cheap and never blocks */
+	memset( &tmx, 0, sizeof(tmx) );
+	tmx.modes = 0;
+	state = adjtimex( &tmx );
+	scale = 1e-6;
+#ifdef STA_NANO
+	if ( tmx.status & STA_NANO )
+		scale = 1e-9;
+#endif
+	mheader( "kernel_state", "gauge", "Kernel clock state (adjtimex return value)." );
+	mprintf( "htpdate_kernel_state %d\n", state );
+	mheader( "kernel_status", "gauge", "Kernel clock status bits." );
+	mprintf( "htpdate_kernel_status %d\n", tmx.status );
+	mheader( "kernel_frequency_ppm", "gauge", "Kernel clock frequency offset." );
+	mprintf( "htpdate_kernel_frequency_ppm %.3f\n", tmx.freq / 65536.0 );
+	mheader( "kernel_offset_seconds", "gauge", "Kernel remaining time offset." );
+	mprintf( "htpdate_kernel_offset_seconds %.9f\n", tmx.offset * scale );
+	mheader( "kernel_maxerror_seconds", "gauge", "Kernel maximum error." );
+	mprintf( "htpdate_kernel_maxerror_seconds %.6f\n", tmx.maxerror * 1e-6 );
+	mheader( "kernel_esterror_seconds", "gauge", "Kernel estimated error." );
+	mprintf( "htpdate_kernel_esterror_seconds %.6f\n", tmx.esterror * 1e-6 );
+}
 
-	case 0:						/* No time adjustment, just print time */
-		printlog( 0, "Offset %.3f seconds", timedelta );
+
+/* Serve one scrape. Plain HTTP for Prometheus, or just the page for
+   clients that send no request (eg. nc -U)
+*/
+static void metrics_serve( void )
+{
+	struct pollfd		pfd;
+	char			req[512], header[128];
+	int			fd, len = 0, http = 0;
+
+	fd = accept( metrics.fd, NULL, NULL );
+	if ( fd < 0 )
+		return;
+
+	/* Give the scraper a moment to send its request, we are idle anyway */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if ( poll( &pfd, 1, 100 ) > 0 )
+		len = recv( fd, req, sizeof(req) - 1, MSG_DONTWAIT );
+	if ( len >= 4 && strncmp( req, "GET ", 4 ) == 0 )
+		http = 1;
+
+	metrics_format();
+
+	if ( http ) {
+		len = snprintf( header, sizeof(header), "HTTP/1.0 200 OK\r\n" \
+		                "Content-Type: text/plain; version=0.0.4\r\n" \
+		                "Content-Length: %d\r\nConnection: close\r\n\r\n", \
+		                metrics.len );
+		send( fd, header, len, MSG_DONTWAIT | MSG_NOSIGNAL );
+	}
+	send( fd, metrics.buf, metrics.len, MSG_DONTWAIT | MSG_NOSIGNAL );
+
+	shutdown( fd, SHUT_WR );
+	close( fd );
+}
+#endif
+
+
+/* Send a state to the service manager (systemd), sd_notify(3) without
+   libsystemd. Nothing happens when not started by it.
+*/
+static void sdnotify( const char *format, ... ) __attribute__ ((format (printf, 1, 2)));
+static void sdnotify( const char *format, ... )
+{
+	struct sockaddr_un	addr;
+	char			state[256];
+	char			*path = getenv( "NOTIFY_SOCKET" );
+	va_list			args;
+	socklen_t		len;
+	int			fd;
+
+	if ( path == NULL || (path[0] != '/' && path[0] != '@') || \
+	     strlen( path ) >= sizeof(addr.sun_path) )
+		return;
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, path );
+	if ( path[0] == '@' )
+		addr.sun_path[0] = '\0';	/* abstract namespace */
+	len = offsetof( struct sockaddr_un, sun_path ) + strlen( path );
+
+	va_start( args, format );
+	vsnprintf( state, sizeof(state), format, args );
+	va_end( args );
+
+	fd = socket( AF_UNIX, SOCK_DGRAM, 0 );
+	if ( fd < 0 )
+		return;
+	sendto( fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, len );
+	close( fd );
+}
+
+
+/* Watchdog keep-alive, at half the interval asked for by systemd */
+static double watchdog_interval( void )
+{
+	char			*usec = getenv( "WATCHDOG_USEC" );
+	char			*pid = getenv( "WATCHDOG_PID" );
+
+	if ( usec == NULL || (pid && atoi( pid ) != getpid()) )
 		return(0);
+	return( atof( usec ) * 1e-6 );
+}
 
-	case 1:						/* Adjust time smoothly */
-		timeofday.tv_sec  = (long)timedelta;
-		timeofday.tv_usec = (long)((timedelta - timeofday.tv_sec) * 1000000);
+static void watchdog( void )
+{
+	static double		last = 0;
+	double			interval = watchdog_interval();
 
-		printlog( 0, "Adjusting %.3f seconds", timedelta );
+	if ( interval > 0 && monotime() - last >= interval / 2 ) {
+		sdnotify( "WATCHDOG=1" );
+		last = monotime();
+	}
+}
 
-		/* Become root */
-		swuid(0);
-		return( adjtime(&timeofday, NULL) );
 
-	case 2:					/* Set time */
-		printlog( 0, "Setting %.3f seconds", timedelta );
+/* Suspend/resume and clock step detection while sleeping */
+static struct {
+	int			fd;		/* timerfd, canceled by a clock set */
+	double			mono, real, boot;	/* clocks at start of sleep */
+	volatile int		detected;
+} jump = { -1 };
+
+
+static double clockread( clockid_t id )
+{
+	struct timespec		ts;
+
+	clock_gettime( id, &ts );
+	return( ts.tv_sec + ts.tv_nsec * 1e-9 );
+}
+
+
+/* Read the clocks as reference, (re)arm the timerfd. A timer on the real
+   time clock with TFD_TIMER_CANCEL_ON_SET is canceled when the clock is
+   set, by anyone, and on resume.
+*/
+static void jump_mark( void )
+{
+#ifdef TFD_TIMER_CANCEL_ON_SET
+	struct itimerspec	its;
+	uint64_t		ticks;
+
+	if ( jump.fd < 0 )
+		jump.fd = timerfd_create( CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC );
+	if ( jump.fd >= 0 ) {
+		/* Clear a pending cancel, eg. of our own settimeofday() */
+		if ( read( jump.fd, &ticks, sizeof(ticks) ) < 0 )
+			errno = 0;
+		memset( &its, 0, sizeof(its) );
+		its.it_value.tv_sec = time(NULL) + 10 * 365 * 86400;
+		timerfd_settime( jump.fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, \
+		                 &its, NULL );
+	}
+#endif
+	jump.mono = clockread( CLOCK_MONOTONIC );
+	jump.real = clockread( CLOCK_REALTIME );
+#ifdef CLOCK_BOOTTIME
+	jump.boot = clockread( CLOCK_BOOTTIME );
+#endif
+}
+
+
+/* Compare the clocks with the reference. Time spent in suspend passes
+   on the boot time clock, not on the monotonic clock. A step of the
+   clock (or a live migrated VM) shows as real time passing differently
+   from monotonic time, more than adjtime() can slew.
+*/
+static int jump_check( void )
+{
+	double			elapsed, delta;
+#ifdef TFD_TIMER_CANCEL_ON_SET
+	uint64_t		ticks;
+
+	if ( jump.fd >= 0 && read( jump.fd, &ticks, sizeof(ticks) ) < 0 && \
+	     errno == ECANCELED ) {
+		printlog( 0, "Clock was set, resynchronizing" );
+		return(1);
+	}
+#endif
+
+	elapsed = clockread( CLOCK_MONOTONIC ) - jump.mono;
+#ifdef CLOCK_BOOTTIME
+	delta = clockread( CLOCK_BOOTTIME ) - jump.boot - elapsed;
+	if ( delta > JUMP_LIMIT ) {
+		printlog( 0, "Resumed after %.0f s, resynchronizing", delta );
+		return(1);
+	}
+#endif
+	delta = clockread( CLOCK_REALTIME ) - jump.real - elapsed;
+	if ( fabs( delta ) > JUMP_LIMIT + elapsed * SLEW_RATE ) {
+		printlog( 0, "Clock jumped %.3f s, resynchronizing", delta );
+		return(1);
+	}
+
+	return(0);
+}
+
+
+/* Open the control socket, a Unix socket for root only */
+static int control_open( char *path )
+{
+	struct sockaddr_un	sun;
+	int			fd;
+
+	memset( &sun, 0, sizeof(sun) );
+	sun.sun_family = AF_UNIX;
+	snprintf( sun.sun_path, sizeof(sun.sun_path), "%s", path );
+	unlink( path );
+
+	fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if ( fd < 0 || bind( fd, (struct sockaddr *)&sun, sizeof(sun) ) || \
+	     chmod( path, 0600 ) || listen( fd, 8 ) ) {
+		printlog( 1, "Error opening control socket %s", path );
+		if ( fd >= 0 )
+			close( fd );
+		return(-1);
+	}
+	fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+
+	control.fd = fd;
+
+	return(0);
+}
+
+
+/* Serve one request, a single line:
+     sync			poll now and set the time, as after a resume
+     status			combined offset, error and drift
+     stats			the metrics page
+     add <host[:port][@path]>	poll another web server
+     remove <host[:port][@path]>	stop polling a web server
+     poll <minpoll> <maxpoll>	new poll interval bounds
+     pause, resume		measure only, or correct the time again
+*/
+static void control_serve( void )
+{
+	struct pollfd		pfd;
+	char			req[URLSIZE + 16], reply[256], *arg;
+	int			fd, len = 0, min, max;
+
+	fd = accept( control.fd, NULL, NULL );
+	if ( fd < 0 )
+		return;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if ( poll( &pfd, 1, 100 ) > 0 )
+		len = recv( fd, req, sizeof(req) - 1, MSG_DONTWAIT );
+	if ( len < 0 )
+		len = 0;
+	req[len] = '\0';
+	req[strcspn( req, "\r\n" )] = '\0';
+	if ( (arg = strchr( req, ' ' )) != NULL )
+		*arg++ = '\0';
+
+	snprintf( reply, sizeof(reply), "ok\n" );
+	if ( strcmp( req, "sync" ) == 0 ) {
+		printlog( 0, "Resynchronizing on request" );
+		jump.detected = 1;
+	} else if ( strcmp( req, "status" ) == 0 ) {
+		snprintf( reply, sizeof(reply), "offset %.6f error %.6f " \
+		          "drift %.2f servers %d%s\n", metrics.offset, \
+		          metrics.error, metrics.drift * 1e6, metrics.numservers, \
+		          control.pause ? " paused" : "" );
+#ifndef DISABLE_METRICS
+	} else if ( strcmp( req, "stats" ) == 0 ) {
+		metrics_format();
+		send( fd, metrics.buf, metrics.len, MSG_DONTWAIT | MSG_NOSIGNAL );
+		reply[0] = '\0';
+#endif
+	} else if ( (strcmp( req, "add" ) == 0 || strcmp( req, "remove" ) == 0) && \
+	            arg && *arg && strlen( arg ) < URLSIZE - 1 ) {
+		if ( control.nedits < MAX_HTTP_HOSTS+1 )
+			snprintf( control.edit[control.nedits++], URLSIZE, "%c%s", \
+			          req[0] == 'a' ? '+' : '-', arg );
+		else
+			snprintf( reply, sizeof(reply), "error: too many changes\n" );
+	} else if ( strcmp( req, "poll" ) == 0 && arg && \
+	            sscanf( arg, "%d %d", &min, &max ) == 2 && min > 0 && max > 0 ) {
+		control.minsleep = min;
+		control.maxsleep = max < min ? min : max;
+	} else if ( strcmp( req, "pause" ) == 0 ) {
+		printlog( 0, "Time adjustments paused" );
+		control.pause = 1;
+	} else if ( strcmp( req, "resume" ) == 0 ) {
+		printlog( 0, "Time adjustments resumed" );
+		control.pause = 0;
+	} else {
+		snprintf( reply, sizeof(reply), "error: unknown request, try sync, " \
+		          "status, stats, add, remove, poll, pause or resume\n" );
+	}
+	send( fd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL );
+
+	shutdown( fd, SHUT_WR );
+	close( fd );
+}
+
+
+/* Add or remove the web servers requested on the control socket, returns
+   the new number of web servers
+*/
+static int control_apply( struct server *servers, int numservers )
+{
+	struct server		*srv;
+	char			*dup, *host, *port, *path;
+	int			e, i;
+
+	for ( e = 0; e < control.nedits; e++ ) {
+		host = dup = strdup( control.edit[e] + 1 );
+		port = DEFAULT_HTTP_PORT;
+		path = strchr( host, '@' );
+		if ( path )
+			*path++ = '\0';
+		else
+			path = "";
+		splithostport( &host, &port );
+
+		for ( i = 0; i < numservers; i++ )
+			if ( strcmp( servers[i].host, host ) == 0 && \
+			     strcmp( servers[i].port, port ) == 0 && \
+			     strcmp( servers[i].path, path ) == 0 )
+				break;
+
+		if ( control.edit[e][0] == '+' ) {
+			if ( i < numservers || numservers >= MAX_HTTP_HOSTS ) {
+				printlog( 1, "Cannot add web server %s:%s", host, port );
+				free( dup );
+				continue;
+			}
+			srv = &servers[numservers];
+			memset( srv, 0, sizeof(*srv) );
+			srv->host = host;
+			srv->port = port;
+			srv->lasterror = NUM_ERRORS;
+			if ( pathparse( srv, path ) ) {
+				free( dup );
+				continue;
+			}
+			numservers++;
+			if ( workers.n )
+				workers_shard( srv, workers.n );
+			printlog( 0, "Added web server %s:%s", host, port );
+		} else {
+			if ( i == numservers || numservers == 1 ) {
+				printlog( 1, "Cannot remove web server %s:%s", host, port );
+				free( dup );
+				continue;
+			}
+			srv = &servers[i];
+#ifdef ENABLE_HTTPS
+			if ( srv->tunnel )
+				tunnelclose( srv );
+			if ( srv->h2 )
+				h2close( srv );
+#endif
+			if ( srv->addr )
+				freeaddrinfo( srv->addr );
+			if ( srv->src )
+				freeaddrinfo( srv->src );
+			numservers--;
+			memmove( srv, srv + 1, (numservers - i) * sizeof(*srv) );
+			printlog( 0, "Removed web server %s:%s", host, port );
+			free( dup );
+		}
+	}
+	control.nedits = 0;
+
+	return(numservers);
+}
+
+
+/* Sleep, meanwhile serve the metrics listener and control socket and
+   watch for clock jumps. A jump or sync request ends the sleep early.
+*/
+static void napsleep( unsigned int seconds )
+{
+	struct pollfd		pfd[3];
+	double			end;
+	int			ms, n, i;
+
+	jump_mark();
+	end = monotime() + seconds;
+	while ( (ms = (int)((end - monotime()) * 1000)) > 0 ) {
+		watchdog();
+		if ( ms > JUMP_CHECK * 1000 )
+			ms = JUMP_CHECK * 1000;
+		if ( watchdog_interval() > 0 && ms > watchdog_interval() * 500 )
+			ms = watchdog_interval() * 500;
+		n = 0;
+		if ( jump.fd >= 0 ) {
+			pfd[n].fd = jump.fd;
+			pfd[n++].events = POLLIN;
+		}
+#ifndef DISABLE_METRICS
+		if ( metrics.fd >= 0 ) {
+			pfd[n].fd = metrics.fd;
+			pfd[n++].events = POLLIN;
+		}
+#endif
+		if ( control.fd >= 0 ) {
+			pfd[n].fd = control.fd;
+			pfd[n++].events = POLLIN;
+		}
+		if ( poll( pfd, n, ms ) > 0 )
+			for ( i = 0; i < n; i++ ) {
+				if ( !(pfd[i].revents & POLLIN) )
+					continue;
+#ifndef DISABLE_METRICS
+				if ( pfd[i].fd == metrics.fd )
+					metrics_serve();
+				else
+#endif
+				if ( pfd[i].fd == control.fd )
+					control_serve();
+			}
+
+#ifdef DISABLE_THREADS
+		/* No log writer to dump the samples on SIGUSR1 */
+		if ( logring.dump ) {
+			logring.dump = 0;
+			sampledump();
+		}
+#endif
+
+		/* A lower maximum poll interval shortens the sleep */
+		if ( control.maxsleep && end - monotime() > control.maxsleep )
+			end = monotime() + control.maxsleep;
+
+		if ( jump.detected || jump_check() ) {
+			jump.detected = 1;
+			return;
+		}
+	}
+}
+
+
+static int realgettime( struct timeval *tv )
+{
+	return( gettimeofday( tv, NULL ) );
+}
+
+static void realwait( struct timespec *ts )
+{
+	nanosleep( ts, NULL );
+}
+
+static int realadjtime( struct timeval *delta )
+{
+	return( adjtime( delta, NULL ) );
+}
+
+static int realsettime( struct timeval *tv )
+{
+	return( settimeofday( tv, NULL ) );
+}
+
+static int realadjtimex( struct timex *tmx )
+{
+	return( adjtimex( tmx ) );
+}
+
+static const struct clockops realops = {
+	realgettime, monotime, realwait, napsleep, httpconnect, httpexchange,
+	realadjtime, realsettime, realadjtimex
+};
+
+
+/* The clock changing primitives of a privilege separated htpdate, they
+   pass the request on to the helper process
+*/
+static int helperrequest( struct helpermsg *msg )
+{
+	if ( send( helperfd, msg, sizeof(*msg), MSG_NOSIGNAL ) != sizeof(*msg) || \
+	     recv( helperfd, msg, sizeof(*msg), 0 ) != sizeof(*msg) ) {
+		printlog( 1, "Clock helper gone" );
+		exit(1);
+	}
+	errno = msg->error;
+	return( msg->result );
+}
+
+static int helperadjtime( struct timeval *delta )
+{
+	struct helpermsg	msg;
+
+	memset( &msg, 0, sizeof(msg) );
+	msg.op = HELPER_ADJTIME;
+	msg.tv = *delta;
+	return( helperrequest( &msg ) );
+}
+
+static int helpersettime( struct timeval *tv )
+{
+	struct helpermsg	msg;
+
+	memset( &msg, 0, sizeof(msg) );
+	msg.op = HELPER_SETTIME;
+	msg.tv = *tv;
+	return( helperrequest( &msg ) );
+}
+
+static int helperadjtimex( struct timex *tmx )
+{
+	struct helpermsg	msg;
+	int			rc;
+
+	memset( &msg, 0, sizeof(msg) );
+	msg.op = HELPER_ADJTIMEX;
+	msg.tmx = *tmx;
+	rc = helperrequest( &msg );
+	*tmx = msg.tmx;
+	return( rc );
+}
+
+static const struct clockops sepops = {
+	realgettime, monotime, realwait, napsleep, httpconnect, httpexchange,
+	helperadjtime, helpersettime, helperadjtimex
+};
+
+
+/* The privileged helper, it only changes the clock on request. Root
+   privileges are dropped, except for CAP_SYS_TIME on Linux.
+*/
+static void helper( int fd, int uid, int gid )
+{
+	struct helpermsg	msg;
+
+#ifdef __linux__
+	if ( prctl( PR_SET_KEEPCAPS, 1 ) < 0 )
+		exit(1);
+	dropprivs( uid, gid );
+	if ( limitcaps() < 0 ) {
+		printlog( 1, "capset()" );
+		exit(1);
+	}
+#endif
+
+	/* Until htpdate itself is gone */
+	while ( recv( fd, &msg, sizeof(msg), 0 ) == sizeof(msg) ) {
+		switch ( msg.op ) {
+		case HELPER_ADJTIME:
+			msg.result = adjtime( &msg.tv, NULL );
+			break;
+		case HELPER_SETTIME:
+			msg.result = settimeofday( &msg.tv, NULL );
+			break;
+		case HELPER_ADJTIMEX:
+			/* Only the frequency, as htpdate_adjtimex() does */
+			if ( msg.tmx.modes & ~MOD_FREQUENCY ) {
+				msg.result = -1;
+				errno = EPERM;
+			} else
+				msg.result = adjtimex( &msg.tmx );
+			break;
+		default:
+			msg.result = -1;
+			errno = EINVAL;
+		}
+		msg.error = msg.result < 0 ? errno : 0;
+		if ( send( fd, &msg, sizeof(msg), MSG_NOSIGNAL ) != sizeof(msg) )
+			break;
+	}
+
+	exit(0);
+}
+
+
+/* Fork the privileged helper, before htpdate drops its privileges */
+static int helper_start( int uid, int gid )
+{
+	int			sv[2];
+	pid_t			pid;
+
+	if ( socketpair( AF_UNIX, SOCK_SEQPACKET, 0, sv ) < 0 ) {
+		printlog( 1, "Error creating clock helper socket" );
+		return(-1);
+	}
+
+	pid = fork();
+	if ( pid < 0 ) {
+		printlog( 1, "Error starting clock helper" );
+		return(-1);
+	}
+	if ( pid == 0 ) {
+		close( sv[0] );
+		helper( sv[1], uid, gid );
+	}
+
+	close( sv[1] );
+	helperfd = sv[0];
+	ops = &sepops;
+
+	return(0);
+}
+
+
+/* Seccomp sandbox for the poll loop, on Linux. Only the system calls
+   needed in the steady state are allowed: networking, name lookups and
+   TLS, threads, sleeping, logging and changing the clock.
+*/
+#if defined __linux__ && defined SECCOMP_SET_MODE_FILTER
+#if defined __x86_64__
+#define	SANDBOX_ARCH			AUDIT_ARCH_X86_64
+#elif defined __aarch64__
+#define	SANDBOX_ARCH			AUDIT_ARCH_AARCH64
+#elif defined __riscv && __riscv_xlen == 64
+#define	SANDBOX_ARCH			AUDIT_ARCH_RISCV64
+#endif
+#endif
+
+#ifdef SANDBOX_ARCH
+static const int	sandboxcalls[] = {
+	/* memory and threads */
+	__NR_brk, __NR_mmap, __NR_munmap, __NR_mprotect, __NR_mremap,
+	__NR_madvise, __NR_futex, __NR_clone, __NR_set_robust_list,
+	__NR_exit, __NR_exit_group, __NR_gettid, __NR_getpid, __NR_sched_yield,
+	__NR_rt_sigaction, __NR_rt_sigprocmask, __NR_rt_sigreturn,
+	__NR_tgkill, __NR_restart_syscall, __NR_prlimit64,
+#ifdef __NR_clone3
+	__NR_clone3,
+#endif
+#ifdef __NR_rseq
+	__NR_rseq,
+#endif
+	/* files: logging, name lookups, CA certificates */
+	__NR_read, __NR_write, __NR_writev, __NR_close, __NR_openat,
+	__NR_lseek, __NR_fstat, __NR_newfstatat, __NR_readlinkat,
+	__NR_faccessat, __NR_fcntl, __NR_ioctl, __NR_uname, __NR_getrandom,
+	__NR_geteuid, __NR_getuid, __NR_getegid, __NR_getgid,
+	__NR_ftruncate, __NR_renameat,		/* journal rotation */
+#ifdef __NR_renameat2
+	__NR_renameat2,
+#endif
+#ifdef __NR_statx
+	__NR_statx,
+#endif
+#ifdef __NR_open
+	__NR_open, __NR_stat, __NR_lstat, __NR_access, __NR_readlink,
+	__NR_rename,
+#endif
+	/* network, metrics and control socket */
+	__NR_socket, __NR_connect, __NR_bind, __NR_accept, __NR_accept4,
+	__NR_sendto, __NR_recvfrom, __NR_sendmsg, __NR_recvmsg, __NR_sendmmsg,
+	__NR_shutdown, __NR_setsockopt, __NR_getsockopt, __NR_getsockname,
+	__NR_getpeername, __NR_ppoll, __NR_pselect6,
+#ifdef __NR_poll
+	__NR_poll, __NR_select,
+#endif
+	/* time */
+	__NR_clock_gettime, __NR_gettimeofday, __NR_clock_nanosleep,
+	__NR_nanosleep, __NR_clock_getres, __NR_adjtimex, __NR_clock_adjtime,
+	__NR_settimeofday, __NR_clock_settime, __NR_timerfd_create,
+	__NR_timerfd_settime,
+#ifdef __NR_time
+	__NR_time,
+#endif
+};
+
+
+/* A forbidden system call, tell which before dying */
+static void sandbox_violation( int sig, siginfo_t *info, void *context )
+{
+	char			msg[64];
+	int			len;
+
+	len = snprintf( msg, sizeof(msg), "htpdate: system call %d not allowed\n", \
+	                info->si_syscall );
+	if ( write( STDERR_FILENO, msg, len ) < 0 )
+		_exit(2);
+	_exit(1);
+}
+#endif
+
+
+/* Install the seccomp filter, on all threads */
+static int sandbox( void )
+{
+#ifdef SANDBOX_ARCH
+	struct sock_filter	filter[sizeof(sandboxcalls)/sizeof(int) + 5];
+	struct sock_fprog	prog;
+	struct sigaction	sa;
+	int			i, n = sizeof(sandboxcalls)/sizeof(int);
+
+#ifdef SIMULATOR
+	/* The virtual clock needs no sandbox */
+	return(0);
+#endif
+
+	/* Right architecture, then compare the system call number with
+	   the allowed ones, any match jumps to "allow" at the end
+	*/
+	filter[0] = (struct sock_filter)BPF_STMT( BPF_LD | BPF_W | BPF_ABS, \
+	            offsetof(struct seccomp_data, arch) );
+	filter[1] = (struct sock_filter)BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, \
+	            SANDBOX_ARCH, 0, n + 1 );
+	filter[2] = (struct sock_filter)BPF_STMT( BPF_LD | BPF_W | BPF_ABS, \
+	            offsetof(struct seccomp_data, nr) );
+	for ( i = 0; i < n; i++ )
+		filter[3 + i] = (struct sock_filter)BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, \
+		                sandboxcalls[i], n - i, 0 );
+	filter[3 + n] = (struct sock_filter)BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_TRAP );
+	filter[4 + n] = (struct sock_filter)BPF_STMT( BPF_RET | BPF_K, SECCOMP_RET_ALLOW );
+
+	prog.len = n + 5;
+	prog.filter = filter;
+
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_sigaction = sandbox_violation;
+	sa.sa_flags = SA_SIGINFO;
+	sigaction( SIGSYS, &sa, NULL );
+
+	if ( prctl( PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0 ) < 0 || \
+	     syscall( SYS_seccomp, SECCOMP_SET_MODE_FILTER, \
+	              SECCOMP_FILTER_FLAG_TSYNC, &prog ) ) {
+		printlog( 1, "Error installing seccomp filter" );
+		return(-1);
+	}
+
+	return(0);
+#else
+	printlog( 1, "Seccomp sandbox not supported on this system" );
+	return(-1);
+#endif
+}
+
+
+/* Local time in seconds, from the (possibly virtual) clock */
+static time_t now( void )
+{
+	struct timeval		tv;
+
+	ops->gettime( &tv );
+	return( tv.tv_sec );
+}
+
+
+/* Write out the buffered output */
+static void output_flush( void )
+{
+	int			n, done = 0;
+
+	while ( done < output.len ) {
+		n = write( STDOUT_FILENO, output.buf + done, output.len - done );
+		if ( n <= 0 && errno != EINTR )
+			break;
+		if ( n > 0 )
+			done += n;
+	}
+	output.len = 0;
+}
+
+
+/* Append to the output buffer, flush it when full */
+static void oprintf( char *format, ... ) __attribute__ ((format (printf, 1, 2)));
+static void oprintf( char *format, ... )
+{
+	va_list			args;
+	int			len, room = sizeof(output.buf) - output.len;
+
+	va_start(args, format);
+	len = vsnprintf( output.buf + output.len, room, format, args );
+	va_end(args);
+
+	if ( len >= room && output.len ) {
+		output_flush();
+		room = sizeof(output.buf);
+		va_start(args, format);
+		len = vsnprintf( output.buf, room, format, args );
+		va_end(args);
+	}
+	if ( len > 0 )
+		output.len += len < room ? len : room - 1;
+}
+
 
-		gettimeofday( &timeofday, NULL );
-		timedelta += ( timeofday.tv_sec + timeofday.tv_usec*1e-6 );
+/* A host, port or path as a field of the output format: quoted when
+   needed in csv, escaped in a json string or as an influx tag value
+*/
+static char *oescape( char *dst, int size, const char *s )
+{
+	char			*t = dst, *end = dst + size - 8;
+	int			quote;
+
+	quote = output.format == OUTPUT_CSV && strpbrk( s, "\",\r\n " ) != NULL;
+	if ( quote )
+		*t++ = '"';
+	for ( ; *s && t < end; s++ ) {
+		if ( output.format == OUTPUT_CSV ) {
+			if ( *s == '"' )
+				*t++ = '"';
+		} else if ( output.format == OUTPUT_JSON ) {
+			if ( *s == '"' || *s == '\\' )
+				*t++ = '\\';
+			else if ( (unsigned char)*s < 0x20 ) {
+				t += sprintf( t, "\\u%04x", *s );
+				continue;
+			}
+		} else if ( *s == ',' || *s == '=' || *s == ' ' || *s == '\\' )
+			*t++ = '\\';
+		*t++ = *s;
+	}
+	if ( quote )
+		*t++ = '"';
+	*t = '\0';
 
-		timeofday.tv_sec  = (long)timedelta;
-		timeofday.tv_usec = (long)(timedelta - timeofday.tv_sec) * 1000000;
+	return( dst );
+}
 
-		printlog( 0, "Set: %s", asctime(localtime(&timeofday.tv_sec)) );
 
-		/* Become root */
-		swuid(0);
-		return( settimeofday(&timeofday, NULL) );
+/* Output a record per web server and one for the poll cycle. A valid
+   sample is "selected" when it contains the combined offset interval,
+   else it is a "falseticker".
+*/
+static void output_cycle( struct server *servers, int numservers, \
+                          int validtimes, int goodtimes, int64_t lo, int64_t hi )
+{
+	struct server		*srv;
+	struct timeval		now;
+	struct tm		tm;
+	char			ts[40], host[256], port[64], path[256], ptag[264];
+	const char		*result, *verdict;
+	int			i;
 
-	case 3:					/* Set frequency, but first an adjust */
-		return( setclock( timedelta, 1 ) );
+	if ( !output.format )
+		return;
 
+	ops->gettime( &now );
+	gmtime_r( &now.tv_sec, &tm );
+	strftime( ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm );
+	snprintf( ts + strlen(ts), sizeof(ts) - strlen(ts), ".%06ldZ", (long)now.tv_usec );
+
+	for ( i = 0; i < numservers; i++ ) {
+		srv = &servers[i];
+		verdict = "";
+		if ( srv->polled != cycle.id )
+			result = "skipped";
+		else if ( srv->lasterror != NUM_ERRORS )
+			result = errorname[srv->lasterror];
+		else {
+			result = "ok";
+			if ( !withinlimit( &srv->sample ) )
+				verdict = "timelimit";
+			else if ( goodtimes && srv->sample.lower <= lo && srv->sample.upper >= hi )
+				verdict = "selected";
+			else
+				verdict = "falseticker";
+		}
 
-	default:
-		return(-1);
+		oescape( host, sizeof(host), srv->host );
+		oescape( port, sizeof(port), srv->port );
+		oescape( path, sizeof(path), srv->path );
+
+		/* An Influx tag can't be empty, leave out a path without */
+		ptag[0] = '\0';
+		if ( output.format == OUTPUT_INFLUX && *srv->path )
+			snprintf( ptag, sizeof(ptag), ",path=%s", path );
+
+		if ( *verdict == '\0' ) {
+			/* No sample, no offset fields */
+			if ( output.format == OUTPUT_CSV )
+				oprintf( "sample,%s,%s,%s,%s,%s,,,,,%s,,,\n", ts, host, \
+				         port, path, srv->address, result );
+			else if ( output.format == OUTPUT_JSON )
+				oprintf( "{\"record\":\"sample\",\"time\":\"%s\",\"host\":\"%s\"," \
+				         "\"port\":\"%s\",\"path\":\"%s\",\"address\":\"%s\"," \
+				         "\"result\":\"%s\"}\n", ts, host, port, \
+				         path, srv->address, result );
+			else
+				oprintf( "htpdate_sample,host=%s,port=%s%s result=\"%s\" %lld%06ld000\n", \
+				         host, port, ptag, result, \
+				         (long long)now.tv_sec, (long)now.tv_usec );
+			continue;
+		}
 
+		if ( output.format == OUTPUT_CSV )
+			oprintf( "sample,%s,%s,%s,%s,%s,%.6f,%.6f,%.6f,%.6f,%s,%s,,\n", ts, \
+			         host, port, path, srv->address, srv->rtt * 1e-6, \
+			         srv->sample.lower * 1e-9, srv->sample.upper * 1e-9, \
+			         ( srv->sample.lower + srv->sample.upper ) * 0.5e-9, \
+			         result, verdict );
+		else if ( output.format == OUTPUT_JSON )
+			oprintf( "{\"record\":\"sample\",\"time\":\"%s\",\"host\":\"%s\"," \
+			         "\"port\":\"%s\",\"path\":\"%s\",\"address\":\"%s\"," \
+			         "\"rtt\":%.6f,\"lower\":%.6f,\"upper\":%.6f,\"offset\":%.6f," \
+			         "\"result\":\"%s\",\"verdict\":\"%s\"}\n", ts, host, \
+			         port, path, srv->address, srv->rtt * 1e-6, \
+			         srv->sample.lower * 1e-9, srv->sample.upper * 1e-9, \
+			         ( srv->sample.lower + srv->sample.upper ) * 0.5e-9, \
+			         result, verdict );
+		else
+			oprintf( "htpdate_sample,host=%s,port=%s%s,address=%s rtt=%.6f," \
+			         "lower=%.6f,upper=%.6f,offset=%.6f,result=\"%s\"," \
+			         "verdict=\"%s\" %lld%06ld000\n", host, port, \
+			         ptag, srv->address, srv->rtt * 1e-6, srv->sample.lower * 1e-9, \
+			         srv->sample.upper * 1e-9, \
+			         ( srv->sample.lower + srv->sample.upper ) * 0.5e-9, \
+			         result, verdict, (long long)now.tv_sec, (long)now.tv_usec );
 	}
 
+	result = goodtimes ? "ok" : "none";
+	if ( !goodtimes )
+		lo = hi = 0;
+	if ( output.format == OUTPUT_CSV )
+		oprintf( "cycle,%s,,,,,,%.6f,%.6f,%.6f,%s,,%d,%d\n", ts, lo * 1e-9, \
+		         hi * 1e-9, ( lo + hi ) * 0.5e-9, result, validtimes, goodtimes );
+	else if ( output.format == OUTPUT_JSON )
+		oprintf( "{\"record\":\"cycle\",\"time\":\"%s\",\"lower\":%.6f," \
+		         "\"upper\":%.6f,\"offset\":%.6f,\"result\":\"%s\"," \
+		         "\"samples\":%d,\"selected\":%d}\n", ts, lo * 1e-9, hi * 1e-9, \
+		         ( lo + hi ) * 0.5e-9, result, validtimes, goodtimes );
+	else
+		oprintf( "htpdate_cycle lower=%.6f,upper=%.6f,offset=%.6f," \
+		         "result=\"%s\",samples=%di,selected=%di %lld%06ld000\n", \
+		         lo * 1e-9, hi * 1e-9, ( lo + hi ) * 0.5e-9, result, \
+		         validtimes, goodtimes, (long long)now.tv_sec, (long)now.tv_usec );
+
+	output_flush();
 }
 
 
-static int htpdate_adjtimex( double drift )
+/* Feed a journal through the combiner and the poll interval controller,
+   offline. Prints a line per poll cycle, the offset as replayed and as
+   journaled. Offsets after a correction are as measured, the replay
+   doesn't change them.
+*/
+static int journal_replay( char *path, int minsleep, int maxsleep, int accuracy )
 {
-	struct timex		tmx;
-	long			freq;
+	struct journalhdr	*hdr;
+	struct journalrec	*rec;
+	struct interval		samples[(MAX_HTTP_HOSTS+1)*(MAX_HTTP_HOSTS+1)-1];
+	struct stat		st;
+	struct tm		tm;
+	time_t			t;
+	char			ts[32];
+	double			offset, drift, starttime = 0, sumsq = 0;
+	int64_t			lo, hi;
+	unsigned		i, id = 0, cycles = 0, corrections = 0;
+	int			fd, n = 0, goodtimes, corrected, sleeptime = minsleep;
+
+	fd = open( path, O_RDONLY );
+	if ( fd < 0 || fstat( fd, &st ) || (size_t)st.st_size < sizeof(*hdr) ) {
+		printlog( 1, "Error opening journal %s", path );
+		return(1);
+	}
+	hdr = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( hdr == MAP_FAILED || hdr->magic != JOURNAL_MAGIC || \
+	     hdr->version != JOURNAL_VERSION || \
+	     hdr->recsize != sizeof(struct journalrec) || \
+	     sizeof(*hdr) + (size_t)hdr->count * sizeof(*rec) > (size_t)st.st_size ) {
+		printlog( 1, "%s is not an htpdate journal", path );
+		return(1);
+	}
 
-	/* Read current kernel frequency */
-	tmx.modes = 0;
-	adjtimex(&tmx);
+	rec = (struct journalrec *)( hdr + 1 );
+	for ( i = 0; i < hdr->count; i++, rec++ ) {
+		/* A cycle cut short (clock jump) has no cycle record */
+		if ( rec->cycle != id ) {
+			id = rec->cycle;
+			n = 0;
+		}
 
-	/* Calculate new frequency */
-	freq = (long)(65536e6 * drift);
+		if ( rec->type == JOURNAL_SAMPLE && n < (int)(sizeof(samples)/sizeof(samples[0])) ) {
+			samples[n].lower = rec->lower;
+			samples[n++].upper = rec->upper;
+			continue;
+		}
+		if ( rec->type != JOURNAL_CYCLE )
+			continue;
 
-	/* Take the average of current and new drift values */
-	tmx.freq = tmx.freq + (freq >> 1);
-	if ( (tmx.freq < -MAX_DRIFT) || (tmx.freq > MAX_DRIFT) )
-		tmx.freq = sign(tmx.freq) * MAX_DRIFT;
+		t = rec->realreceived / 1000000000;
+		gmtime_r( &t, &tm );
+		strftime( ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", &tm );
 
-	printlog( 0, "Adjusting frequency %li", tmx.freq );
-	tmx.modes = MOD_FREQUENCY;
+		goodtimes = marzullo( samples, n, &lo, &hi );
+		if ( goodtimes == 0 ) {
+			printf( "%s cycle %u: no valid samples\n", ts, id );
+			n = 0;
+			continue;
+		}
+
+		offset = ( lo + hi ) * 0.5e-9;
+		corrected = lo > 0 || hi < 0;
+		if ( corrected ) {
+			if ( starttime ) {
+				drift = offset / ( t - starttime );
+				pollctl_drift( drift );
+			}
+			starttime = t;
+			corrections++;
+		}
+		sleeptime = pollctl_update( sleeptime, minsleep, maxsleep, \
+		                            offset, accuracy * 1e-6, corrected );
+		cycles++;
+		sumsq += offset * offset;
+
+		printf( "%s cycle %u: %d of %d samples [%.3f, %.3f] offset %.3f s " \
+		        "(journal %.3f s)%s, poll %d s\n", ts, id, goodtimes, n, \
+		        lo * 1e-9, hi * 1e-9, offset, ( rec->lower + rec->upper ) * 0.5e-9, \
+		        corrected ? ", correct" : "", sleeptime );
+		n = 0;
+	}
 
-	/* Become root */
-	swuid(0);
-	return( adjtimex(&tmx) );
+	if ( cycles )
+		printf( "%u cycles, %u corrections, rms offset %.3f s\n", \
+		        cycles, corrections, sqrt( sumsq / cycles ) );
 
+	return(0);
 }
 
 
 static void showhelp()
 {
 	puts("htpdate version "VERSION"\n\
-Usage: htpdate [-046abdhlqstxD] [-i pid file] [-m minpoll] [-M maxpoll]\n\
-               [-p precision] [-P <proxyserver>[:port]] [-u user[:group]]\n\
-               <host[:port]> ...\n\n\
+Usage: htpdate [-0246abdfhlqstxzD] [-A accuracy] [-c control] [-e metrics]\n\
+               [-i pid file] [-j workers] [-J journal] [-m minpoll] [-M maxpoll]\n\
+               [-N shm unit] [-o csv|json|influx] [-p precision]\n\
+               [-P <proxyserver>[:port]] [-R journal] [-u user[:group]]\n\
+               [-w status file] <host[:port][@path]> ...\n\n\
   -0    HTTP/1.0 request\n\
+  -2    HTTP/2 for HTTPS web servers\n\
   -4    Force IPv4 name resolution only\n\
   -6    Force IPv6 name resolution only\n\
   -a    adjust time smoothly\n\
+  -A    accuracy target (ms), for the poll interval (default 500)\n\
   -b    burst mode\n\
+  -c    control socket path\n\
   -d    debug mode\n\
+  -e    metrics listener, [address:]port or unix socket path\n\
   -D    daemon mode\n\
+  -f    TCP Fast Open, the request in the SYN (HTTP only)\n\
   -F    foreground mode\n\
   -h    help\n\
   -i    pid file\n\
+  -j    number of measurement worker threads\n\
+  -J    append every poll to a measurement journal file\n\
   -l    use syslog for output\n\
   -m    minimum poll interval\n\
   -M    maximum poll interval\n\
+  -N    export offset to NTP shared memory unit, don't change time\n\
+  -o    output format of the poll results, csv, json or influx\n\
   -p    precision (ms)\n\
   -P    proxy server\n\
+  -R    replay a journal file through the combiner, offline\n\
   -q    query only, don't make time changes (default)\n\
   -s    set time\n\
   -t    turn off sanity time check\n\
   -u    run daemon as user\n\
+  -w    write status page to file\n\
   -x    adjust kernel clock\n\
+  -z    seccomp sandbox for the poll loop (Linux)\n\
   host  web server hostname or ip address (maximum of 16)\n\
-  port  port number (default 80 and 8080 for proxy server)\n");
+  port  port number (default 80 and 8080 for proxy server)\n\
+  path  src=address,dev=interface,mark=fwmark of the connections\n");
+#ifdef SIMULATOR
+	puts("Simulator: -S days=,drift=(PPM),offset=,rtt=,jitter=,loss=,servers=,target=,seed=\n\
+  eg. htpsim -x -m 600 -S days=14,drift=30,offset=2 a.example b.example\n");
+#endif
 
 	return;
 }
@@ -541,12 +4756,19 @@ Usage: htpdate [-046abdhlqstxD] [-i pid file] [-m minpoll] [-M maxpoll]\n\
 /* Run htpdate in daemon mode */
 static void runasdaemon( char *pidfile )
 {
-	FILE		*pid_file;
+	char		buf[32];
 	pid_t		pid;
+	int		fd;
 
-	/* Check if htpdate is already running (pid exists)*/
-	pid_file = fopen(pidfile, "r");
-	if ( pid_file ) {
+	/* Check if htpdate is already running. The pid file stays locked
+	   as long as the daemon runs, a stale pid file doesn't matter.
+	*/
+	fd = open( pidfile, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+	if ( fd < 0 ) {
+		fputs( "Error opening pid file\n", stderr );
+		exit(1);
+	}
+	if ( flock( fd, LOCK_EX | LOCK_NB ) < 0 ) {
 		fputs( "htpdate already running\n", stderr );
 		exit(1);
 	}
@@ -588,38 +4810,284 @@ static void runasdaemon( char *pidfile )
 		exit(1);
 	}
 
-	if ( pid > 0 ) {
-		/* Write a pid file */
-		pid_file = fopen( pidfile, "w" );
-		if ( !pid_file ) {
-			printlog( 1, "Error writing pid file" );
-			exit(1);
-		} else {
-			fprintf( pid_file, "%u\n", (unsigned int)pid );
-			fclose( pid_file );
-		}
-		printlog( 0, "htpdate version "VERSION" started" );
+	if ( pid > 0 )
 		exit(0);
+
+	/* Write the pid file, the lock is inherited and kept */
+	snprintf( buf, sizeof(buf), "%u\n", (unsigned int)getpid() );
+	if ( ftruncate( fd, 0 ) < 0 || write( fd, buf, strlen(buf) ) < 0 ) {
+		printlog( 1, "Error writing pid file" );
+		exit(1);
+	}
+	printlog( 0, "htpdate version "VERSION" started" );
+	sdnotify( "MAINPID=%u", (unsigned int)getpid() );
+
+}
+
+
+#ifdef SIMULATOR
+/* Simulator, runs the daemon loop on a virtual clock against modeled web
+   servers. The local clock runs off by the oscillator drift plus the kernel
+   frequency correction, adjtime() slews it at 500 PPM. Web servers have a
+   fixed offset and the network a random delay, the Date: header is truncated
+   to whole seconds like real web servers do.
+*/
+static struct {
+	double			t;		/* true time */
+	double			phase;		/* local clock - true time */
+	double			drift;		/* oscillator frequency error */
+	double			freq;		/* kernel frequency correction */
+	double			slew;		/* remaining adjtime() correction */
+	double			start, end;
+	double			rtt, jitter, loss, servers, target;
+	uint64_t		seed;
+	double			*errors;	/* |phase| every SIM_STEP */
+	unsigned long		nerrors, maxerrors;
+	unsigned long		probes;
+} sim = {
+	1.7e9, 2.5, 20e-6, 0, 0, 0, 7 * 86400,
+	0.05, 0.02, 0, 0.01, 0.5, 1
+};
+
+
+/* Deterministic random numbers (xorshift64*), uniform in [0, 1) */
+static double sim_random( void )
+{
+	sim.seed ^= sim.seed >> 12;
+	sim.seed ^= sim.seed << 25;
+	sim.seed ^= sim.seed >> 27;
+	return( (sim.seed * 2685821657736338717ULL >> 11) * (1.0 / 9007199254740992.0) );
+}
+
+
+/* Parse days=,drift=(PPM),offset=,rtt=,jitter=,loss=,servers=,target=,seed= */
+static int sim_options( char *options )
+{
+	char			*tokens[] = { "days", "drift", "offset", "rtt", "jitter", \
+	                                      "loss", "servers", "target", "seed", NULL };
+	char			*value;
+
+	while ( *options ) {
+		switch ( getsubopt( &options, tokens, &value ) ) {
+		case 0: sim.end = atof( value ) * 86400; break;
+		case 1: sim.drift = atof( value ) * 1e-6; break;
+		case 2: sim.phase = atof( value ); break;
+		case 3: sim.rtt = atof( value ); break;
+		case 4: sim.jitter = atof( value ); break;
+		case 5: sim.loss = atof( value ); break;
+		case 6: sim.servers = atof( value ); break;
+		case 7: sim.target = atof( value ); break;
+		case 8: sim.seed = strtoull( value, NULL, 10 ) | 1; break;
+		default:
+			fprintf( stderr, "Invalid simulation parameter %s\n", value );
+			return(-1);
+		}
+		if ( value == NULL ) {
+			fputs( "Missing simulation parameter value\n", stderr );
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+
+/* Let true time pass, the local clock follows with its own rate */
+static void sim_advance( double dt )
+{
+	double			step;
+
+	sim.t += dt;
+	sim.phase += dt * ( sim.drift + sim.freq );
+
+	step = dt * SIM_SLEW_RATE;
+	if ( step > ( sim.slew < 0 ? -sim.slew : sim.slew ) )
+		step = sim.slew < 0 ? -sim.slew : sim.slew;
+	step *= sign(sim.slew);
+	sim.phase += step;
+	sim.slew -= step;
+}
+
+
+/* Convergence time is the last moment the clock was off more than the
+   target, the residual error is measured from then on
+*/
+static void sim_report( void )
+{
+	unsigned long		i, last = 0;
+	double			sumsq = 0, max = 0;
+
+	for ( i = 0; i < sim.nerrors; i++ )
+		if ( sim.errors[i] > sim.target )
+			last = i + 1;
+
+	for ( i = last; i < sim.nerrors; i++ ) {
+		sumsq += sim.errors[i] * sim.errors[i];
+		if ( sim.errors[i] > max )
+			max = sim.errors[i];
+	}
+
+	printlog( 0, "Simulated %.1f days, %lu probes, drift %.2f PPM, " \
+	          "kernel frequency %.2f PPM", (sim.t - sim.start) / 86400, \
+	          sim.probes, sim.drift * 1e6, sim.freq * 1e6 );
+	if ( last < sim.nerrors ) {
+		printlog( 0, "Converged within %.3f s after %.0f s", sim.target, \
+		          (double)last * SIM_STEP );
+		printlog( 0, "Residual error rms %.6f s, max %.6f s", \
+		          sqrt( sumsq / (sim.nerrors - last) ), max );
+	} else {
+		printlog( 1, "Not converged within %.3f s, final error %.6f s", \
+		          sim.target, sim.phase );
+	}
+}
+
+
+static int sim_gettime( struct timeval *tv )
+{
+	double			local = sim.t + sim.phase;
+
+	tv->tv_sec = (time_t)local;
+	tv->tv_usec = (long)((local - tv->tv_sec) * 1e6);
+	return(0);
+}
+
+static void sim_wait( struct timespec *ts )
+{
+	sim_advance( ts->tv_sec + ts->tv_nsec * 1e-9 );
+}
+
+static void sim_sleep( unsigned int seconds )
+{
+	double			end = sim.t + seconds;
+	double			dt;
+
+	while ( sim.t < end ) {
+		dt = end - sim.t < SIM_STEP ? end - sim.t : SIM_STEP;
+		sim_advance( dt );
+
+		if ( sim.nerrors == sim.maxerrors ) {
+			sim.maxerrors = sim.maxerrors ? sim.maxerrors * 2 : 1024;
+			sim.errors = realloc( sim.errors, sim.maxerrors * sizeof(double) );
+			if ( sim.errors == NULL ) {
+				printlog( 1, "Out of memory" );
+				exit(1);
+			}
+		}
+		sim.errors[sim.nerrors++] = sim.phase < 0 ? -sim.phase : sim.phase;
+
+		if ( sim.t >= sim.end ) {
+			sim_report();
+			exit(0);
+		}
+	}
+}
+
+static double sim_monotime( void )
+{
+	return( sim.t );
+}
+
+static int sim_connect( struct server *srv, char *proxy, char *proxyport, int ipversion )
+{
+	sim_advance( sim.rtt );
+	return(0);
+}
+
+/* The web server answers halfway the round trip, with its own offset */
+static int sim_exchange( struct server *srv, int server_s, char *buffer )
+{
+	struct tm		tm;
+	time_t			date;
+	double			rtt, offset;
+	char			*c;
+	uint64_t		seed = sim.seed;
+
+	sim.probes++;
+	rtt = sim.rtt + sim.jitter * sim_random();
+	if ( sim_random() < sim.loss ) {
+		sim_advance( rtt );
+		return(0);
 	}
 
+	/* A fixed offset per web server, derived from its name */
+	sim.seed = 1469598103934665603ULL;
+	for ( c = srv->host; *c; c++ )
+		sim.seed = (sim.seed ^ (unsigned char)*c) * 1099511628211ULL;
+	offset = sim.servers * ( 2 * sim_random() - 1 );
+	sim.seed = seed;
+
+	srv->sent = sim.t;
+	date = (time_t)( sim.t + rtt / 2 + offset );
+	sim_advance( rtt );
+	srv->firstbyte = sim.t;
+
+	gmtime_r( &date, &tm );
+	strftime( buffer, BUFFERSIZE, "HTTP/1.1 200 OK\r\n" \
+	          "Date: %a, %d %b %Y %H:%M:%S GMT\r\n\r\n", &tm );
+	return(1);
+}
+
+static int sim_adjtime( struct timeval *delta )
+{
+	sim.slew = delta->tv_sec + delta->tv_usec * 1e-6;
+	return(0);
+}
+
+static int sim_settime( struct timeval *tv )
+{
+	sim.phase = tv->tv_sec + tv->tv_usec * 1e-6 - sim.t;
+	return(0);
+}
+
+static int sim_adjtimex( struct timex *tmx )
+{
+	if ( tmx->modes & MOD_FREQUENCY )
+		sim.freq = tmx->freq / 65536e6;
+	tmx->freq = (long)( sim.freq * 65536e6 );
+	return(0);
+}
+
+static const struct clockops simops = {
+	sim_gettime, sim_monotime, sim_wait, sim_sleep, sim_connect, sim_exchange,
+	sim_adjtime, sim_settime, sim_adjtimex
+};
+
+
+static void sim_start( void )
+{
+	sim.start = sim.t;
+	sim.end += sim.t;
+	ops = &simops;
+
+	printlog( 0, "Simulating %.1f days, offset %.3f s, drift %.2f PPM, " \
+	          "rtt %.3f s, jitter %.3f s", (sim.end - sim.start) / 86400, \
+	          sim.phase, sim.drift * 1e6, sim.rtt, sim.jitter );
 }
+#endif
 
 
 int main( int argc, char *argv[] )
 {
-	char			*host = NULL, *proxy = NULL, *proxyport = NULL;
-	char			*port = NULL;
-	char			*hostport = NULL;
+	char			*proxy = NULL, *proxyport = NULL;
+	char			*statusfile = NULL;
+#ifndef DISABLE_METRICS
+	char			*metricsaddr = NULL;
+#endif
+	char			*controlpath = NULL;
+	char			*journalfile = NULL, *replayfile = NULL;
+	char			*format = NULL, *path;
 	char			*httpversion = DEFAULT_HTTP_VERSION;
 	char			*pidfile = DEFAULT_PID_FILE;
 	char			*user = NULL, *userstr = NULL, *group = NULL;
-	long long		sumtimes;
-	double			timeavg, drift = 0;
-	int			timedelta[(MAX_HTTP_HOSTS+1)*(MAX_HTTP_HOSTS+1)-1], timestamp;
-	int			numservers, validtimes, goodtimes, mean;
+	double			timeavg, timeerr, drift = 0, polltime, slew;
+	int			numservers, validtimes, goodtimes;
+	int64_t			lo = 0, hi = 0;
 	int			nap = 0, when = 500000, precision = 0;
-	int			setmode = 0, burstmode = 0, try, offsetdetect;
-	int			i, burst, param;
+	int			accuracy = DEFAULT_ACCURACY;
+	int			setmode = 0, burstmode = 0, nworkers = 0, initmode;
+	int			seccomp = 0;
+	int			settle, ready = 0, notified = 0;
+	int			i, param;
 	int			daemonize = 0;
 	int			foreground = 0;
 	int			ipversion = DEFAULT_IP_VERSION;
@@ -628,8 +5096,12 @@ int main( int argc, char *argv[] )
 	int			maxsleep = DEFAULT_MAX_SLEEP;
 	int			sleeptime = minsleep;
 	int			sw_uid = 0, sw_gid = 0;
+	int			shmunit = -1;
 	time_t			starttime = 0;
 
+	struct server		servers[MAX_HTTP_HOSTS+1];
+	struct server		proxysrv;
+	struct server		*srv;
 	struct passwd		*pw;
 	struct group		*gr;
 
@@ -638,12 +5110,19 @@ int main( int argc, char *argv[] )
 
 
 	/* Parse the command line switches and arguments */
-	while ( (param = getopt(argc, argv, "046abdhi:lm:p:qstu:xDFM:P:") ) != -1)
+	while ( (param = getopt(argc, argv, "0246abc:de:fhi:j:lm:o:p:qstu:w:xzA:DFJ:M:N:P:R:" SIMOPTIONS) ) != -1)
 		switch( param ) {
 
 		case '0':			/* HTTP/1.0 */
 			httpversion = "0";
 			break;
+		case '2':			/* HTTP/2 for HTTPS */
+#ifdef ENABLE_HTTPS
+			http2 = 1;
+#else
+			printlog( 1, "HTTP/2 requires HTTPS support" );
+#endif
+			break;
 		case '4':			/* IPv4 only */
 			ipversion = 4;
 			break;
@@ -653,18 +5132,55 @@ int main( int argc, char *argv[] )
 		case 'a':			/* adjust time */
 			setmode = 1;
 			break;
+		case 'A':			/* accuracy target */
+			accuracy = atoi(optarg);
+			if ( (accuracy <= 0) || (accuracy > 10000) ) {
+				fputs( "Invalid accuracy\n", stderr );
+				exit(1);
+			}
+			accuracy *= 1000;
+			break;
 		case 'b':			/* burst mode */
 			burstmode = 1;
 			break;
+		case 'c':			/* control socket */
+			controlpath = (char *)optarg;
+			break;
 		case 'd':			/* turn debug on */
 			debug = 1;
 			break;
+		case 'e':			/* metrics listener */
+#ifdef DISABLE_METRICS
+			fputs( "Metrics listener not compiled in\n", stderr );
+			exit(1);
+#else
+			metricsaddr = (char *)optarg;
+#endif
+			break;
+		case 'f':			/* TCP Fast Open */
+#ifndef TCP_FASTOPEN_CONNECT
+			fputs( "TCP Fast Open not supported\n", stderr );
+			exit(1);
+#endif
+			fastopen = 1;
+			break;
 		case 'h':			/* show help */
 			showhelp();
 			exit(0);
 		case 'i':			/* pid file */
 			pidfile = (char *)optarg;
 			break;
+		case 'j':			/* worker threads */
+#ifdef DISABLE_THREADS
+			fputs( "Worker threads not compiled in\n", stderr );
+			exit(1);
+#endif
+			nworkers = atoi(optarg);
+			if ( (nworkers < 1) || (nworkers > MAX_WORKERS) ) {
+				fputs( "Invalid number of workers\n", stderr );
+				exit(1);
+			}
+			break;
 		case 'l':			/* log mode */
 			logmode = 1;
 			break;
@@ -675,6 +5191,19 @@ int main( int argc, char *argv[] )
 			}
 			sleeptime = minsleep;
 			break;
+		case 'o':			/* output format */
+			format = (char *)optarg;
+			if ( strcmp( format, "csv" ) == 0 )
+				output.format = OUTPUT_CSV;
+			else if ( strcmp( format, "json" ) == 0 )
+				output.format = OUTPUT_JSON;
+			else if ( strcmp( format, "influx" ) == 0 )
+				output.format = OUTPUT_INFLUX;
+			else {
+				fputs( "Invalid output format\n", stderr );
+				exit(1);
+			}
+			break;
 		case 'p':			/* precision */
 			precision = atoi(optarg) ;
 			if ( (precision <= 0) || (precision >= 500) ) {
@@ -714,9 +5243,15 @@ int main( int argc, char *argv[] )
 				}
 			}
 			break;
+		case 'w':			/* status page */
+			statusfile = (char *)optarg;
+			break;
 		case 'x':			/* adjust time and "kernel" */
 			setmode = 3;
 			break;
+		case 'z':			/* seccomp sandbox */
+			seccomp = 1;
+			break;
 		case 'D':			/* run as daemon */
 			daemonize = 1;
 			logmode = 1;
@@ -724,23 +5259,63 @@ int main( int argc, char *argv[] )
 		case 'F':			/* run in the foreground */
 			foreground = 1;
 			break;
+		case 'J':			/* measurement journal */
+			journalfile = (char *)optarg;
+			break;
 		case 'M':			/* maximum poll interval */
 			if ( ( maxsleep = atoi(optarg) ) <= 0 ) {
 				fputs( "Invalid sleep time\n", stderr );
 				exit(1);
 			}
 			break;
+		case 'N':			/* export to NTP shared memory */
+#ifdef DISABLE_NTPSHM
+			fputs( "NTP shared memory export not compiled in\n", stderr );
+			exit(1);
+#endif
+			shmunit = atoi(optarg);
+			if ( (shmunit < 0) || (shmunit >= NTPD_SHM_UNITS) ) {
+				fputs( "Invalid shm unit\n", stderr );
+				exit(1);
+			}
+			break;
 		case 'P':
 			proxy = (char *)optarg;
 			proxyport = DEFAULT_PROXY_PORT;
 			splithostport( &proxy, &proxyport );
+			memset( &proxysrv, 0, sizeof(proxysrv) );
+			proxysrv.host = proxy;
+			proxysrv.port = proxyport;
+			metrics.proxy = &proxysrv;
+			break;
+		case 'R':			/* replay a journal */
+			replayfile = (char *)optarg;
+			break;
+#ifdef SIMULATOR
+		case 'S':			/* simulation parameters */
+			if ( sim_options( (char *)optarg ) < 0 )
+				exit(1);
 			break;
+#endif
 		case '?':
 			return 1;
 		default:
 			abort();
 		}
 
+	/* Exporting to NTP shm leaves the clock alone, whatever the order */
+	if ( shmunit >= 0 ) {
+		if ( setmode ) {
+			fputs( "-N cannot be combined with -a, -s or -x\n", stderr );
+			exit(1);
+		}
+		setmode = 4;
+	}
+
+	/* Offline, no web servers involved */
+	if ( replayfile )
+		exit( journal_replay( replayfile, minsleep, maxsleep, accuracy ) );
+
 	/* Display help page, if no servers are specified */
 	if ( argv[optind] == NULL ) {
 		showhelp();
@@ -754,9 +5329,48 @@ int main( int argc, char *argv[] )
 		exit(1);
 	}
 
-	/* One must be "root" to change the system time */
-	if ( (getuid() != 0) && (setmode || daemonize || foreground) ) {
-		fputs( "Only root can change time\n", stderr );
+	/* host:port is stored in argv[i] */
+	memset( servers, 0, sizeof(servers) );
+	for ( i = 0; i < numservers; i++ ) {
+		servers[i].host = strdup( argv[optind + i] );
+		servers[i].port = DEFAULT_HTTP_PORT;
+		servers[i].lasterror = NUM_ERRORS;
+		path = strchr( servers[i].host, '@' );
+		if ( path )
+			*path++ = '\0';
+		splithostport( &servers[i].host, &servers[i].port );
+		if ( pathparse( &servers[i], path ? path : "" ) )
+			exit(1);
+
+#ifndef ENABLE_HTTPS
+		if ( ishttps( &servers[i] ) )
+			printlog( 1, "HTTPS support not compiled in, "
+			          "cannot get timestamp from %s", servers[i].host);
+#endif
+	}
+
+#ifdef SIMULATOR
+	/* Simulate the daemon loop, in the foreground and on a virtual clock */
+	daemonize = 0;
+	foreground = 1;
+	nworkers = 0;			/* the virtual clock is single threaded */
+	sim_start();
+#else
+	ops = &realops;
+#endif
+
+	/* One must be "root" (or have CAP_SYS_TIME) to change the system
+	   time, NTP shm units 2 and up are world writable
+	*/
+	if ( ops == &realops && !cansettime() && (setmode || daemonize || foreground) && \
+	     !(setmode == 4 && shmunit >= 2) ) {
+		fputs( "Only root (or CAP_SYS_TIME) can change time\n", stderr );
+		exit(1);
+	}
+
+	/* A daemon has no stdout to write records to */
+	if ( output.format && daemonize ) {
+		fputs( "Output format (-o) requires foreground or one-shot mode\n", stderr );
 		exit(1);
 	}
 
@@ -769,195 +5383,323 @@ int main( int argc, char *argv[] )
 	if ( (daemonize || foreground) && !setmode ) {
 		setmode = 1;
 	}
+	initmode = setmode;
 
-	/* Now we are root, we drop the privileges (if specified) */
-	if ( sw_gid ) swgid( sw_gid );
-	if ( sw_uid ) swuid( sw_uid );
+	/* Privilege separation, when running as another user only a helper
+	   process keeps the privilege to change the clock. Before any threads
+	   are started.
+	*/
+	if ( ops == &realops && sw_uid && setmode && setmode != 4 && \
+	     helper_start( sw_uid, sw_gid ) < 0 )
+		exit(1);
 
-	/* In case we have more than one web server defined, we
-	   spread the polls equal within a second and take a "nap" in between
+	/* From now on log messages are written by a separate thread, as
+	   key=value records when running as a daemon
 	*/
-	if ( numservers > 1 )
-		if ( precision && (numservers > 2) )
-			nap = (1000000 - 2*precision) / (numservers - 1);
-		else
-			nap = 1000000 / (numservers + 1);
-	else {
+	log_start( daemonize || foreground );
+
+	/* Attach to the NTP shared memory segment, before dropping privileges */
+#ifndef DISABLE_NTPSHM
+	if ( setmode == 4 && ntpshm_attach( shmunit ) < 0 )
+		exit(1);
+#endif
+
+	/* A web server, proxy or metrics client closing its end of a
+	   kept-alive connection makes a write fail (EPIPE), not the process
+	*/
+	signal( SIGPIPE, SIG_IGN );
+
+	/* Create the status page, before dropping privileges */
+	if ( statusfile && status_open( statusfile ) < 0 )
+		exit(1);
+
+	/* Likewise the journal */
+	if ( journalfile && journal_open( journalfile ) < 0 )
+		exit(1);
+
+	/* Open the metrics listener, only useful for a long running htpdate */
+#ifndef DISABLE_METRICS
+	if ( metricsaddr && (daemonize || foreground) && \
+	     metrics_open( metricsaddr ) < 0 )
+		exit(1);
+#endif
+	metrics.servers = servers;
+	metrics.numservers = numservers;
+
+	/* Open the control socket, likewise */
+	if ( controlpath && (daemonize || foreground) && \
+	     control_open( controlpath ) < 0 )
+		exit(1);
+
+	/* Now we are root, we drop the privileges (if specified) */
+	if ( sw_uid ) dropprivs( sw_uid, sw_gid );
+
+	/* Not root, but with capabilities: only keep the one to set the time */
+	if ( ops == &realops && geteuid() != 0 && limitcaps() < 0 )
+		printlog( 1, "capset()" );
+
+	nap = napspread( numservers, precision );
+	if ( numservers == 1 )
 		precision = 0;
-		nap = 500000;
-	}
 
 #ifdef ENABLE_HTTPS
-	SSL_load_error_strings ();
-	SSL_library_init ();
+	if ( tls_init() < 0 ) {
+		fputs( "TLS initialization failed\n", stderr );
+		exit(1);
+	}
+#endif
+
+	/* Poll settings, shared with the worker threads */
+	cycle.proxy = proxy;
+	cycle.proxyport = proxyport;
+	cycle.httpversion = httpversion;
+	cycle.ipversion = ipversion;
+	cycle.timelimit = timelimit;
+	cycle.burstmode = burstmode;
+	cycle.numservers = numservers;
+	cycle.nap = nap;
+
+#ifndef DISABLE_THREADS
+	if ( nworkers && workers_start( nworkers, servers, numservers ) < 0 )
+		exit(1);
 #endif
 
+	/* Everything is set up, restrict the poll loop to what it needs */
+	if ( seccomp && sandbox() < 0 )
+		exit(1);
+
+	if ( output.format == OUTPUT_CSV )
+		oprintf( "record,time,host,port,path,address,rtt,lower,upper,offset," \
+		         "result,verdict,samples,selected\n" );
+
 	/* Infinite poll cycle loop in daemonize or foreground mode */
 	do {
 
-		/* Initialize number of received valid timestamps, good timestamps
-		   and the average of the good timestamps
+		/* After a suspend or clock step start over as if just started:
+		   poll at the minimum interval, step the time if allowed
 		*/
-		validtimes = goodtimes = sumtimes = offsetdetect = 0;
+		watchdog();
+
+		/* Changes requested on the control socket */
+		if ( control.minsleep ) {
+			printlog( 0, "Poll interval %d - %d s", control.minsleep, control.maxsleep );
+			minsleep = control.minsleep;
+			maxsleep = control.maxsleep;
+			if ( sleeptime < minsleep )
+				sleeptime = minsleep;
+			if ( sleeptime > maxsleep )
+				sleeptime = maxsleep;
+			control.minsleep = control.maxsleep = 0;
+		}
+		if ( control.nedits ) {
+			numservers = control_apply( servers, numservers );
+			cycle.numservers = metrics.numservers = numservers;
+			cycle.nap = nap = napspread( numservers, precision );
+		}
+
+		if ( jump.detected ) {
+			jump.detected = 0;
+			sleeptime = minsleep;
+			setmode = initmode;
+			starttime = 0;
+			pollctl.cycles = pollctl.count = 0;
+			pollctl.last = 0;
+		}
+
+		/* Initialize number of received valid timestamps */
+		cycle.validtimes = cycle.offsetdetect = 0;
+		cycle.id++;
+		polltime = 0;
 		if ( precision )
 			when = precision;
 		else
 			when = nap;
 
-		/* Loop through the time sources (web servers); poll cycle */
-		for ( i = optind; i < argc; i++ ) {
-
-			/* host:port is stored in argv[i] */
-			hostport = (char *)argv[i];
-			host = strdup(hostport);
-			port = DEFAULT_HTTP_PORT;
-			splithostport( &host, &port );
+		/* Probe the proxy server itself, for its round trip time and
+		   its own clock
+		*/
+		if ( proxy != NULL ) {
+			proxysrv.lastpoll = 0;
+			getHTTPdate( &proxysrv, NULL, NULL, httpversion, ipversion, when );
+		}
 
-#ifndef ENABLE_HTTPS
-			if (strncmp (port, "443", 3) == 0)
-				printlog( 1, "HTTPS support not compiled in, "
-				          "cannot get timestamp from %s", host);
+#ifndef DISABLE_THREADS
+		/* All web servers at once, the whole poll interval is slept
+		   after the samples are combined and the clock corrected
+		*/
+		if ( workers.n )
+			polltime = workers_poll( when );
 #endif
 
-			/* if burst mode, reset "when" */
-			if ( burstmode ) {
-				if ( precision )
-					when = precision;
-				else
-					when = nap;
-			}
-
-			burst = 0;
-			do {
-				/* Retry if first poll shows time offset */
-				try = MAX_ATTEMPT;
-				do {
-					if ( debug ) printlog( 0, "burst: %d try: %d when: %d", \
-						                       burst + 1, MAX_ATTEMPT - try + 1, when );
-					timestamp = getHTTPdate( host, port, proxy, proxyport,\
-					                         httpversion, ipversion, when );
-					try--;
-				} while ( timestamp && try );
-
-				/* Only include valid responses in timedelta[] */
-				if ( timelimit == NO_TIME_LIMIT || ( timestamp < timelimit && timestamp > -timelimit ) ) {
-					timedelta[validtimes] = timestamp;
-					validtimes++;
-				}
-
-				/* If we detected a time offset, set the flag */
-				if ( timestamp )
-					offsetdetect = 1;
-
-				/* Take a nap, to spread polls equally within a second.
-				   Example:
-				   2 servers => 0.333, 0.666
-				   3 servers => 0.250, 0.500, 0.750
-				   4 servers => 0.200, 0.400, 0.600, 0.800
-				   ...
-				   nap = 1000000 / (#servers + 1)
-
-				   or when "precision" is specified, a different algorithm is used
-				*/
-				when += nap;
+		/* Loop through the time sources (web servers); poll cycle */
+		for ( i = 0; i < numservers && !workers.n && !jump.detected; i++ ) {
 
-				burst++;
-			} while ( burst < (argc - optind) * burstmode );
+			srv = &servers[i];
+			polltime += pollserver( srv, pollwhen( when, i ) );
+			watchdog();
 
-			/* Sleep for a while, unless we detected a time offset */
-			if ( (daemonize || foreground) && !offsetdetect )
-				sleep( sleeptime / numservers );
+			/* Sleep for a while, unless we detected a time offset or
+			   the time wasn't set yet after startup (readiness).
+			   An offset is never corrected in NTP shm mode, always sleep.
+			*/
+			if ( (daemonize || foreground) && ready && \
+			     (!cycle.offsetdetect || setmode == 4) )
+				ops->sleep( sleeptime / numservers );
 
 		}
 
-		/* Sort the timedelta results */
-		insertsort( timedelta, validtimes );
+		/* Samples from before a jump are of no use */
+		if ( jump.detected )
+			continue;
 
-		/* Mean time value */
-		mean = timedelta[validtimes/2];
+		metrics.cycles++;
+		metrics.cycletime = polltime;
+		validtimes = cycle.validtimes;
 
-		/* Filter out the bogus timevalues. A timedelta which is more than
-		   1 seconde off from mean, is considered a 'false ticker'.
-		   NTP synced web servers can never be more off than a second.
+		/* Every sample is an interval which contains the true offset
+		   (of an NTP synced web server). The offset lies where most
+		   intervals agree, those which don't are 'false tickers'.
+		   Samples taken at different instants within a second narrow
+		   down the offset to a fraction of a second.
 		*/
-		for ( i = 0; i < validtimes; i++ ) {
-			if ( timedelta[i]-mean <= 1 && timedelta[i]-mean >= -1 ) {
-				sumtimes += timedelta[i];
-				goodtimes++;
-			}
-		}
+		goodtimes = marzullo( cycle.samples, validtimes, &lo, &hi );
+		journal_cycle( validtimes, goodtimes, lo, hi );
+		output_cycle( servers, numservers, validtimes, goodtimes, lo, hi );
 
 		/* Check if we have at least one valid response */
 		if ( goodtimes ) {
 
-			timeavg = sumtimes/(double)goodtimes;
+			timeavg = ( lo + hi ) * 0.5e-9;
+			timeerr = ( hi - lo ) * 0.5e-9;
 
 			if ( debug ) {
-				printlog( 0, "#: %d mean: %d average: %.3f", goodtimes, \
-				          mean, timeavg );
+				printlog( 0, "#: %d interval: [%.3f, %.3f] offset: %.3f", \
+				          goodtimes, lo * 1e-9, hi * 1e-9, timeavg );
 			}
 
-			/* Do I really need to change the time?  */
-			if ( sumtimes || !(daemonize || foreground) ) {
+			status_update( servers, numservers, timeavg, timeerr, drift, 1 );
+			settle = 0;
+			metrics.offset = timeavg;
+			metrics.error = timeerr;
+
+			/* A proxy server which rewrites Date: headers makes every web
+			   server agree with its own clock, when that is off
+			*/
+			if ( proxy != NULL && proxysrv.lastpoll && \
+			     (proxysrv.sample.lower > 0 || proxysrv.sample.upper < 0) && \
+			     proxysrv.sample.lower <= lo && proxysrv.sample.upper >= hi )
+				printlog( 1, "Web server time matches the clock of proxy %s, " \
+				          "Date: headers may be rewritten by the proxy", proxy );
+
+			/* Adjustments paused on the control socket, only measure */
+			if ( control.pause ) {
+				sleeptime = pollctl_update( sleeptime, minsleep, maxsleep, \
+				                            timeavg, accuracy * 1e-6, 0 );
+			}
+			/* Leave the clock alone and let ntpd or chrony do the
+			   disciplining, they want a steady stream of samples
+			*/
+			else if ( setmode == 4 ) {
+#ifndef DISABLE_NTPSHM
+				if ( ntpshm_update( timeavg, timeerr ) < 0 )
+					printlog( 1, "NTP shm update failed" );
+#endif
+				sleeptime = minsleep;
+			}
+			/* Do I really need to change the time? Not if a zero
+			   offset is within the interval.
+			*/
+			else if ( lo > 0 || hi < 0 || !(daemonize || foreground) ) {
 				/* If a precision was specified and the time offset is small
-				   (< +-1 second), adjust the time with the value of precision
+				   (< +-1 second), adjust the time by at most precision
 				*/
-				if ( precision && sumtimes < goodtimes && sumtimes > -goodtimes )
-					timeavg = (double)precision / 1000000 * sign(sumtimes);
+				if ( precision && fabs( timeavg ) < 1 && \
+				     fabs( timeavg ) > precision * 1e-6 )
+					timeavg = precision * 1e-6 * sign(timeavg);
 
 				/* Correct the clock, if not in "adjtimex" mode */
 				if ( setclock( timeavg, setmode ) < 0 )
 					printlog( 1, "Time change failed" );
-
-				/* Drop root privileges again */
-				swuid( sw_uid );
+				else if ( setmode && timeavg ) {
+					metrics.adjustments++;
+					metrics.adjustsum += timeavg < 0 ? -timeavg : timeavg;
+					metrics.lastadjust = timeavg;
+				}
 
 				if ( daemonize || foreground ) {
 					if ( starttime ) {
 						/* Calculate systematic clock drift */
-						drift = timeavg / ( time(NULL) - starttime );
+						drift = timeavg / ( now() - starttime );
 						printlog( 0, "Drift %.2f PPM, %.2f s/day", \
 						          drift*1e6, drift*86400 );
+						metrics.drift = drift;
+						pollctl_drift( drift );
 
 						/* Adjust system clock */
 						if ( setmode == 3 ) {
-							starttime = time(NULL);
+							starttime = now();
 							/* Adjust the kernel clock */
 							if ( htpdate_adjtimex( drift ) < 0 )
 								printlog( 1, "Frequency change failed" );
-
-							/* Drop root privileges again */
-							swuid( sw_uid );
+							else
+								metrics.freqadjustments++;
 						}
 					} else {
-						starttime = time(NULL);
+						starttime = now();
 					}
 
-					/* Decrease polling interval to minimum */
-					sleeptime = minsleep;
-
-					/* Sleep for 30 minutes after a time adjust or set */
-					sleep( DEFAULT_MIN_SLEEP );
+					sleeptime = pollctl_update( sleeptime, minsleep, maxsleep, \
+					                            timeavg, accuracy * 1e-6, 1 );
+
+					/* A detected offset skipped the sleeps in between
+					   polls, sleep now, at least until adjtime() is done,
+					   but no longer than the longest poll interval
+					*/
+					slew = setmode == 2 ? 0 : fabs( timeavg ) / SLEW_RATE;
+					if ( slew > maxsleep )
+						slew = maxsleep;
+					settle = slew > sleeptime ? (int)slew : sleeptime;
 				}
 			} else {
-				/* Increase polling interval */
-				if ( sleeptime < maxsleep )
-					sleeptime <<= 1;
+				sleeptime = pollctl_update( sleeptime, minsleep, maxsleep, \
+				                            timeavg, accuracy * 1e-6, 0 );
 			}
 			if ( debug && (daemonize || foreground) )
-				printlog( 0, "poll %ld s", sleeptime );
+				printlog( 0, "poll %d s", sleeptime );
+
+			/* Ready after the first poll cycle, whether it synced
+			   or not, a host without network must still boot
+			*/
+			sdnotify( "%sSTATUS=Offset %.3f s (+/- %.3f s), %d of %d servers, poll %d s", \
+			          notified ? "" : "READY=1\n", timeavg, timeerr, goodtimes, \
+			          numservers, sleeptime );
+			notified = 1;
+			/* Polls skipped their sleeps for a correction which
+			   didn't happen (or the time wasn't set yet), sleep now.
+			   Workers never sleep in between polls.
+			*/
+			if ( (workers.n || !ready || (cycle.offsetdetect && setmode != 4)) && \
+			     (daemonize || foreground) && settle < sleeptime )
+				settle = sleeptime;
+			ready = 1;
+			if ( settle )
+				ops->sleep( settle );
 
 		} else {
 			printlog( 1, "No server suitable for synchronization found" );
+			status_update( servers, numservers, 0, 0, drift, 0 );
+			sdnotify( "%sSTATUS=No server suitable for synchronization found", \
+			          notified ? "" : "READY=1\n" );
+			notified = 1;
 			/* Sleep for minsleep to avoid flooding */
 			if ( daemonize || foreground )
-				sleep( minsleep );
+				ops->sleep( minsleep );
 			else
 				exit(1);
 		}
 
 		/* After first poll cycle do not step through time, only adjust */
-		if ( setmode != 3 ) {
+		if ( setmode != 3 && setmode != 4 ) {
 			setmode = 1;
 		}
 
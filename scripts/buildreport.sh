@@ -0,0 +1,50 @@
+#! /bin/sh
+#
+# Build htpdate in a few configurations and report the binary size and the
+# startup time (exec until exit, of "htpdate -h"), eg. to pick a variant
+# for an initramfs or a small router. Run from the source directory, or
+# with "make report". Pass extra make variables as arguments, eg.
+#
+#   sh scripts/buildreport.sh ENABLE_HTTPS=1
+
+MAKE=${MAKE:-make}
+RUNS=${RUNS:-200}
+MINIMAL="DISABLE_METRICS=1 DISABLE_NTPSHM=1 DISABLE_THREADS=1"
+OUT=`mktemp -d` || exit 1
+trap 'rm -rf $OUT' EXIT
+
+# Average wall clock time of a run in microseconds, needs date +%N
+startup() {
+	start=`date +%s%N`
+	case $start in
+	*N)	echo "n/a"; return ;;
+	esac
+	i=0
+	while [ $i -lt $RUNS ]; do
+		$1 -h >/dev/null 2>&1
+		i=$((i + 1))
+	done
+	end=`date +%s%N`
+	echo $(( (end - start) / RUNS / 1000 ))
+}
+
+report() {
+	name=$1; target=$2; shift 2
+	$MAKE -s clean >/dev/null
+	if ! $MAKE -s $target "$@" >/dev/null 2>&1; then
+		printf "%-24s build failed\n" "$name"
+		return
+	fi
+	mv $target $OUT/$name
+	printf "%-24s %10s %10s\n" "$name" \
+	       `wc -c < $OUT/$name` `startup $OUT/$name`
+}
+
+printf "%-24s %10s %10s\n" "variant" "bytes" "start(us)"
+report default htpdate "$@"
+report small htpdate SMALL=1 "$@"
+report small-minimal htpdate SMALL=1 $MINIMAL "$@"
+report static htpdate-static "$@"
+report static-small htpdate-static SMALL=1 "$@"
+report static-small-minimal htpdate-static SMALL=1 $MINIMAL "$@"
+$MAKE -s clean >/dev/null
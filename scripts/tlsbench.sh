@@ -0,0 +1,69 @@
+#! /bin/sh
+#
+# Compare the TLS backends: binary size, size of the linked TLS libraries,
+# CPU time of a one-shot query over HTTPS (mostly the handshake) and of
+# just starting up, and the peak memory of a query (needs GNU time).
+# Run from the source directory, against a web server you may poll often:
+#
+#   sh scripts/tlsbench.sh www.example.com:443 [runs]
+#
+# Extra make variables go in MAKEARGS, eg. MAKEARGS="SMALL=1".
+
+SERVER=${1:?"Usage: $0 host:port [runs]"}
+RUNS=${2:-20}
+MAKE=${MAKE:-make}
+OUT=`mktemp -d` || exit 1
+trap 'rm -rf $OUT' EXIT
+
+# CPU time of the children of this shell in ms, times must not run in
+# a subshell
+cputime() {
+	tail -1 $1 | tr 'ms' '  ' | \
+	awk '{ printf "%d\n", ($1 + $3) * 60000 + ($2 + $4) * 1000 }'
+}
+
+# Average CPU time of a run, in ms
+cpu() {
+	times > $OUT/start
+	i=0
+	while [ $i -lt $RUNS ]; do
+		"$@" >/dev/null 2>&1
+		i=$((i + 1))
+	done
+	times > $OUT/end
+	awk "BEGIN { printf \"%.1f\", (`cputime $OUT/end` - `cputime $OUT/start`) / $RUNS }"
+}
+
+# Peak resident set size in KB
+rss() {
+	if /usr/bin/time -f %M true >/dev/null 2>&1; then
+		/usr/bin/time -f %M "$@" 2>&1 >/dev/null | tail -1
+	else
+		echo "n/a"
+	fi
+}
+
+# Bytes of the shared TLS libraries the binary loads
+libsize() {
+	ldd $1 2>/dev/null | awk '/ssl|crypto|mbed/ { print $3 }' | \
+	xargs -r cat | wc -c
+}
+
+printf "%-10s %10s %10s %12s %12s %10s\n" \
+       "backend" "bytes" "lib bytes" "start(ms)" "query(ms)" "rss(KB)"
+for tls in openssl mbedtls; do
+	$MAKE -s clean >/dev/null
+	if ! $MAKE -s htpdate ENABLE_HTTPS=1 TLS=$tls $MAKEARGS >/dev/null 2>&1; then
+		printf "%-10s build failed\n" $tls
+		continue
+	fi
+	mv htpdate $OUT/$tls
+	if ! $OUT/$tls -q $SERVER >/dev/null 2>&1; then
+		printf "%-10s query of %s failed\n" $tls $SERVER
+		continue
+	fi
+	printf "%-10s %10s %10s %12s %12s %10s\n" $tls `wc -c < $OUT/$tls` \
+	       `libsize $OUT/$tls` `cpu $OUT/$tls -h` \
+	       `cpu $OUT/$tls -q $SERVER` `rss $OUT/$tls -q $SERVER`
+done
+$MAKE -s clean >/dev/null